@@ -18,7 +18,7 @@ IOReturn VoodooI2CHIDDeviceOverride::getHIDDescriptor() {
     return parseHIDDescriptor();
 }
 
-IOReturn VoodooI2CHIDDeviceOverride::newReportDescriptor(IOMemoryDescriptor** descriptor) const {
+IOReturn VoodooI2CHIDDeviceOverride::getReportDescriptor() {
     IOLog("%s::%s Overriding report descriptor\n", getName(), name);
 
     if (!hid_descriptor->wReportDescLength) {
@@ -26,15 +26,14 @@ IOReturn VoodooI2CHIDDeviceOverride::newReportDescriptor(IOMemoryDescriptor** de
         return kIOReturnDeviceError;
     }
 
-    IOBufferMemoryDescriptor* report_descriptor = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, hid_descriptor->wReportDescLength);
+    IOBufferMemoryDescriptor* descriptor = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, hid_descriptor->wReportDescLength);
 
-    if (!report_descriptor) {
+    if (!descriptor) {
         IOLog("%s::%s Could not allocated buffer for report descriptor\n", getName(), name);
         return kIOReturnNoResources;
     }
 
-    report_descriptor->writeBytes(0, report_descriptor_override, hid_descriptor->wReportDescLength);
-    *descriptor = report_descriptor;
+    descriptor->writeBytes(0, report_descriptor_override, hid_descriptor->wReportDescLength);
 
-    return kIOReturnSuccess;
+    return parseReportDescriptor(descriptor);
 }
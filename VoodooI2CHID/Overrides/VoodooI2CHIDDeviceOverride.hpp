@@ -19,7 +19,7 @@ class VoodooI2CHIDDeviceOverride : public VoodooI2CHIDDevice {
     UInt8* report_descriptor_override;
     
     IOReturn getHIDDescriptor() override;
-    IOReturn newReportDescriptor(IOMemoryDescriptor** descriptor) const override;
+    IOReturn getReportDescriptor() override;
 };
 
 
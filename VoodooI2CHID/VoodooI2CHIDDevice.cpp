@@ -17,67 +17,171 @@ bool VoodooI2CHIDDevice::init(OSDictionary* properties) {
     if (!super::init(properties))
         return false;
     awake = true;
-    read_in_progress = true;
-    read_in_progress_mutex = IOLockAlloc();
+    device_work_loop = NULL;
+    bus_lock = IOLockAlloc();
+    bus_busy = false;
+    input_pending = 0;
+    command_yield_timeouts = 0;
+    memset(&input_bus_wait_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&command_bus_wait_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    input_thread_lock = IOLockAlloc();
+    input_thread = NULL;
+    input_thread_running = false;
+    input_thread_should_exit = false;
+    pending_interrupts = 0;
+    pending_interrupt_time = 0;
+    fast_resume = false;
+    wake_time = 0;
+    interrupts_received = 0;
+    interrupts_coalesced = 0;
+    interrupts_dropped = 0;
+    input_report_allocations = 0;
+    memset(&interrupt_to_read_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&read_duration_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&read_to_report_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&wake_to_report_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    polling_interval = INTERRUPT_SIMULATOR_MIN_INTERVAL;
+    polling_interval_minimum = INTERRUPT_SIMULATOR_MIN_INTERVAL;
+    polling_interval_maximum = INTERRUPT_SIMULATOR_MAX_INTERVAL;
+    polling_idle_threshold = INTERRUPT_SIMULATOR_IDLE_THRESHOLD;
+    polling_idle_count = 0;
+    polled_report = false;
+    input_report_pool_free = 0;
+    memset(input_report_pool, 0, sizeof(input_report_pool));
     ready_for_input = false;
     reset_event = false;
+    reset_pending = false;
+    reset_timed_out = false;
     hid_descriptor = reinterpret_cast<VoodooI2CHIDDeviceHIDDescriptor*>(IOMalloc(sizeof(VoodooI2CHIDDeviceHIDDescriptor)));
     memset(hid_descriptor, 0, sizeof(VoodooI2CHIDDeviceHIDDescriptor));
 
-    buf_i2c_cnt_intr = 0;
-    buf_i2c_cnt = 0;
-    buf_i2c_pool_intr = (UInt8 *)IOMalloc(I2C_MAX_BUF_SIZE);
-    buf_i2c_pool = (UInt8 *)IOMalloc(I2C_MAX_BUF_SIZE);
+    report_descriptor = NULL;
+    report_descriptor_length = 0;
+    report_descriptor_version = 0;
+    report_descriptor_checksum = 0;
+
+    memset(&input_arena, 0, sizeof(VoodooI2CHIDDeviceBufferArena));
+    memset(&command_arena, 0, sizeof(VoodooI2CHIDDeviceBufferArena));
+    input_arena.pool = (UInt8 *)IOMalloc(I2C_MAX_BUF_SIZE);
+    command_arena.pool = (UInt8 *)IOMalloc(I2C_MAX_BUF_SIZE);
+
+    if (!input_arena.pool || !command_arena.pool)
+        return false;
     
     return true;
 }
 
 void VoodooI2CHIDDevice::free() {
     IOFree(hid_descriptor, sizeof(VoodooI2CHIDDeviceHIDDescriptor));
-    IOFree(buf_i2c_pool_intr, I2C_MAX_BUF_SIZE);
-    IOFree(buf_i2c_pool, I2C_MAX_BUF_SIZE);
-    if (read_in_progress_mutex) {
-        IOLockFree(read_in_progress_mutex);
-        read_in_progress_mutex = NULL;
+    OSSafeReleaseNULL(report_descriptor);
+    if (input_arena.pool)
+        IOFree(input_arena.pool, I2C_MAX_BUF_SIZE);
+    if (command_arena.pool)
+        IOFree(command_arena.pool, I2C_MAX_BUF_SIZE);
+    if (bus_lock) {
+        IOLockFree(bus_lock);
+        bus_lock = NULL;
+    }
+    if (input_thread_lock) {
+        IOLockFree(input_thread_lock);
+        input_thread_lock = NULL;
+    }
+    if ((vm_address_t) device_work_loop >> 1) {
+        device_work_loop->release();
+        device_work_loop = NULL;
     }
 
     super::free();
 }
 
-UInt8* VoodooI2CHIDDevice::getMallocI2CIntr(UInt16 size) {
-    if ((buf_i2c_cnt_intr + size + 0x10) >= I2C_MAX_BUF_SIZE)
-        buf_i2c_cnt_intr = 0;
-    UInt8* retaddr = (buf_i2c_pool_intr + buf_i2c_cnt_intr);
-    buf_i2c_cnt_intr += size + 0x10;
+UInt8* VoodooI2CHIDDevice::acquireI2CBuffer(VoodooI2CHIDDeviceBufferArena* arena, UInt32 size) {
+    // Keep slices 16 byte aligned as the old bump allocator did
     
-    return retaddr;
+    UInt32 slice_size = (size + 0xF) & ~0xF;
+    UInt8* buffer;
+
+    if (slice_size && arena->offset + slice_size <= I2C_MAX_BUF_SIZE) {
+        buffer = arena->pool + arena->offset;
+        arena->offset += slice_size;
+        arena->outstanding++;
+
+        if (arena->offset > arena->high_water_mark)
+            arena->high_water_mark = arena->offset;
+    } else {
+        // Either the request is larger than the arena or the arena is still holding slices
+        // that are in use, never hand those out again
+
+        if (slice_size > I2C_MAX_BUF_SIZE)
+            arena->oversized++;
+        else if (slice_size)
+            arena->busy++;
+
+        buffer = reinterpret_cast<UInt8*>(IOMalloc(size));
+
+        if (!buffer) {
+            IOLog("%s::%s Could not allocate %u byte I2C buffer\n", getName(), name, size);
+            return NULL;
+        }
+    }
+
+    memset(buffer, 0, size);
+
+    return buffer;
 }
 
-UInt8* VoodooI2CHIDDevice::getMallocI2C(UInt16 size) {
-    if ((buf_i2c_cnt + size + 0x10) >= I2C_MAX_BUF_SIZE)
-        buf_i2c_cnt = 0;
-    UInt8* retaddr = (buf_i2c_pool + buf_i2c_cnt);
-    buf_i2c_cnt += size + 0x10;
-    
-    return retaddr;
+void VoodooI2CHIDDevice::releaseI2CBuffer(VoodooI2CHIDDeviceBufferArena* arena, UInt8* buffer, UInt32 size) {
+    if (!buffer)
+        return;
+
+    if (buffer < arena->pool || buffer >= arena->pool + I2C_MAX_BUF_SIZE) {
+        IOFree(buffer, size);
+        return;
+    }
+
+    if (arena->outstanding && !--arena->outstanding)
+        arena->offset = 0;
 }
 
 IOReturn VoodooI2CHIDDevice::getHIDDescriptor() {
     I2C_LOCK();
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*)getMallocI2C(sizeof(VoodooI2CHIDDeviceCommand));
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*)acquireI2CBuffer(&command_arena, sizeof(VoodooI2CHIDDeviceCommand));
+    if (!command) {
+        I2C_UNLOCK();
+        return kIOReturnNoResources;
+    }
     command->c.reg = hid_descriptor_register;
 
-    if (api->writeReadI2C(command->data, 2, (UInt8*)hid_descriptor, (UInt16)sizeof(VoodooI2CHIDDeviceHIDDescriptor)) != kIOReturnSuccess) {
+    IOReturn ret = api->writeReadI2C(command->data, 2, (UInt8*)hid_descriptor, (UInt16)sizeof(VoodooI2CHIDDeviceHIDDescriptor));
+    releaseI2CBuffer(&command_arena, (UInt8*)command, sizeof(VoodooI2CHIDDeviceCommand));
+
+    if (ret != kIOReturnSuccess) {
         I2C_UNLOCK();
         IOLog("%s::%s Request for HID descriptor failed\n", getName(), name);
         return kIOReturnIOError;
     }
-    IOReturn ret = parseHIDDescriptor();
+    ret = parseHIDDescriptor();
     I2C_UNLOCK();
 
     return ret;
 }
 
+void VoodooI2CHIDDevice::refreshHIDDescriptor() {
+    VoodooI2CHIDDeviceHIDDescriptor previous = *hid_descriptor;
+
+    if (getHIDDescriptor() != kIOReturnSuccess) {
+        *hid_descriptor = previous;
+        return;
+    }
+
+    if (hid_descriptor->wMaxInputLength != previous.wMaxInputLength)
+        IOLog("%s::%s Maximum input length changed from %d to %d\n", getName(), name, previous.wMaxInputLength, hid_descriptor->wMaxInputLength);
+
+    // <newReportDescriptor> fetches the report descriptor again once it no longer matches
+
+    if (report_descriptor && (report_descriptor_length != hid_descriptor->wReportDescLength || report_descriptor_version != hid_descriptor->wVersionID))
+        IOLog("%s::%s HID descriptor changed, report descriptor will be fetched again\n", getName(), name);
+}
+
 IOReturn VoodooI2CHIDDevice::parseHIDDescriptor() {
     if (hid_descriptor->bcdVersion != 0x0100) {
         IOLog("%s::%s Incorrect BCD version %d\n", getName(), name, hid_descriptor->bcdVersion);
@@ -111,6 +215,88 @@ IOReturn VoodooI2CHIDDevice::parseHIDDescriptor() {
     return kIOReturnSuccess;
 }
 
+IOReturn VoodooI2CHIDDevice::getReportDescriptor() {
+    if (!hid_descriptor->wReportDescLength) {
+        IOLog("%s::%s Invalid report descriptor size\n", getName(), name);
+        return kIOReturnDeviceError;
+    }
+
+    IOBufferMemoryDescriptor* descriptor = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, hid_descriptor->wReportDescLength);
+
+    if (!descriptor) {
+        IOLog("%s::%s Could not allocated buffer for report descriptor\n", getName(), name);
+        return kIOReturnNoResources;
+    }
+
+    I2C_LOCK();
+
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*)acquireI2CBuffer(&command_arena, sizeof(VoodooI2CHIDDeviceCommand));
+    if (!command) {
+        I2C_UNLOCK();
+        descriptor->release();
+        return kIOReturnNoResources;
+    }
+    command->c.reg = hid_descriptor->wReportDescRegister;
+
+    // Read straight into the descriptor that will be handed to IOHIDFamily
+
+    IOReturn ret = api->writeReadI2C(command->data, 2, reinterpret_cast<UInt8*>(descriptor->getBytesNoCopy()), hid_descriptor->wReportDescLength);
+    releaseI2CBuffer(&command_arena, (UInt8*)command, sizeof(VoodooI2CHIDDeviceCommand));
+
+    I2C_UNLOCK();
+
+    if (ret != kIOReturnSuccess) {
+        descriptor->release();
+        IOLog("%s::%s Could not get report descriptor\n", getName(), name);
+        return kIOReturnIOError;
+    }
+
+    return parseReportDescriptor(descriptor);
+}
+
+IOReturn VoodooI2CHIDDevice::parseReportDescriptor(IOBufferMemoryDescriptor* descriptor) {
+    UInt8* bytes = reinterpret_cast<UInt8*>(descriptor->getBytesNoCopy());
+    IOByteCount length = descriptor->getLength();
+    bool blank = true;
+
+    // A descriptor that reads back as all zeroes or all ones means that the device did not answer
+
+    for (IOByteCount i = 1; i < length; i++) {
+        if (bytes[i] != bytes[0]) {
+            blank = false;
+            break;
+        }
+    }
+
+    if (!length || (blank && (bytes[0] == 0x00 || bytes[0] == 0xFF))) {
+        IOLog("%s::%s Report descriptor is blank\n", getName(), name);
+        descriptor->release();
+        return kIOReturnInvalid;
+    }
+
+    // Fletcher-32 over the descriptor bytes
+
+    UInt32 sum_1 = 0, sum_2 = 0;
+    for (IOByteCount i = 0; i < length; i++) {
+        sum_1 = (sum_1 + bytes[i]) % 0xFFFF;
+        sum_2 = (sum_2 + sum_1) % 0xFFFF;
+    }
+    UInt32 checksum = (sum_2 << 16) | sum_1;
+
+    if (report_descriptor && checksum != report_descriptor_checksum)
+        IOLog("%s::%s Report descriptor changed\n", getName(), name);
+
+    OSSafeReleaseNULL(report_descriptor);
+    report_descriptor = descriptor;
+    report_descriptor_length = hid_descriptor->wReportDescLength;
+    report_descriptor_version = hid_descriptor->wVersionID;
+    report_descriptor_checksum = checksum;
+
+    setProperty("ReportDescriptorChecksum", report_descriptor_checksum, 32);
+
+    return kIOReturnSuccess;
+}
+
 IOReturn VoodooI2CHIDDevice::getHIDDescriptorAddress() {
     UInt32 guid_1 = 0x3CDFF6F7;
     UInt32 guid_2 = 0x45554267;
@@ -162,22 +348,38 @@ IOReturn VoodooI2CHIDDevice::getHIDDescriptorAddress() {
     return kIOReturnSuccess;
 }
 
-void VoodooI2CHIDDevice::getInputReport() {
+bool VoodooI2CHIDDevice::getInputReport(uint64_t interrupt_time) {
     IOBufferMemoryDescriptor* buffer;
     IOReturn ret;
     int return_size;
     unsigned char* report;
+    uint64_t read_start, read_end, report_end;
 
-    if (I2C_TRYLOCK() == false) {
-        IOLog("%s::%s Skipping a HID read interrupt while other thread read/write I2C\n", getName(), name);
-        goto exit;
+    // Wait for any command in flight rather than dropping the report, the interrupt
+    // line stays asserted until the report has been read
+
+    I2C_INPUT_LOCK();
+    report = acquireI2CBuffer(&input_arena, hid_descriptor->wMaxInputLength);
+    if (!report) {
+        I2C_UNLOCK();
+        interrupts_dropped++;
+        return false;
     }
-    report = getMallocI2CIntr(hid_descriptor->wMaxInputLength);
-    report[0] = report[1] = 0;
+
+    clock_get_uptime(&read_start);
+    if (interrupt_time)
+        recordLatency(&interrupt_to_read_latency, interrupt_time, read_start);
+
     ret = api->readI2C(report, hid_descriptor->wMaxInputLength);
+
+    clock_get_uptime(&read_end);
+    recordLatency(&read_duration_latency, read_start, read_end);
+
     if (ret != kIOReturnSuccess) {
+        releaseI2CBuffer(&input_arena, report, hid_descriptor->wMaxInputLength);
         I2C_UNLOCK();
-        goto exit;
+        interrupts_dropped++;
+        return false;
     }
 
     return_size = report[0] | report[1] << 8;
@@ -187,40 +389,279 @@ void VoodooI2CHIDDevice::getInputReport() {
      * It needs to be checked before checking ready_for_input.
      */
      if (!return_size) {
+        releaseI2CBuffer(&input_arena, report, hid_descriptor->wMaxInputLength);
         I2C_UNLOCK();
-        command_gate->commandWakeup(&reset_event);
-        goto exit;
+
+        // Pick up any change the reset made to the HID descriptor before anything waiting for it goes ahead,
+        // an empty read while polling an idle device does not need to take the gate
+
+        if (reset_pending) {
+            refreshHIDDescriptor();
+            command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::completeResetGated));
+        }
+
+        return false;
     }
 
-    if (!ready_for_input || return_size > hid_descriptor->wMaxInputLength) {
+    if (!ready_for_input || return_size < 2 || return_size > hid_descriptor->wMaxInputLength) {
+        releaseI2CBuffer(&input_arena, report, hid_descriptor->wMaxInputLength);
         I2C_UNLOCK();
-        goto exit;
+        interrupts_dropped++;
+        return true;
+    }
+
+    buffer = acquireInputReportBuffer(return_size - 2);
+    if (!buffer) {
+        releaseI2CBuffer(&input_arena, report, hid_descriptor->wMaxInputLength);
+        I2C_UNLOCK();
+        interrupts_dropped++;
+        return true;
     }
 
-    buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, return_size);
     buffer->writeBytes(0, report + 2, return_size - 2);
+    releaseI2CBuffer(&input_arena, report, hid_descriptor->wMaxInputLength);
     
     I2C_UNLOCK();
     
     ret = handleReport(buffer, kIOHIDReportTypeInput);
     if (ret != kIOReturnSuccess)
         IOLog("%s::%s Error handling input report: 0x%.8x\n", getName(), name, ret);
+
+    clock_get_uptime(&report_end);
+    recordLatency(&read_to_report_latency, read_end, report_end);
+
+    if (wake_time) {
+        recordLatency(&wake_to_report_latency, wake_time, report_end);
+        wake_time = 0;
+    }
     
+    releaseInputReportBuffer(buffer);
+
+    return true;
+}
+
+IOReturn VoodooI2CHIDDevice::allocateInputReportPool() {
+    // Devices that only take output or feature reports never read an input report
+
+    if (!hid_descriptor->wMaxInputLength)
+        return kIOReturnSuccess;
+
+    for (int i = 0; i < I2C_INPUT_REPORT_POOL_SIZE; i++) {
+        input_report_pool[i] = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, hid_descriptor->wMaxInputLength);
+
+        if (!input_report_pool[i]) {
+            IOLog("%s::%s Could not allocate input report pool\n", getName(), name);
+            return kIOReturnNoResources;
+        }
+    }
+
+    input_report_pool_free = (1 << I2C_INPUT_REPORT_POOL_SIZE) - 1;
+
+    return kIOReturnSuccess;
+}
+
+IOBufferMemoryDescriptor* VoodooI2CHIDDevice::acquireInputReportBuffer(IOByteCount length) {
+    UInt32 free;
+
+    while ((free = input_report_pool_free)) {
+        UInt32 index = __builtin_ctz(free);
+
+        if (OSCompareAndSwap(free, free & ~(1 << index), &input_report_pool_free)) {
+            IOBufferMemoryDescriptor* buffer = input_report_pool[index];
+
+            // The pool is sized for the maximum input length at start, which a reset may have raised
+
+            if (buffer->getCapacity() < length) {
+                releaseInputReportBuffer(buffer);
+                break;
+            }
+
+            buffer->setLength(length);
+            return buffer;
+        }
+    }
+
+    // Every pooled descriptor is still in use, this should not happen in steady state
+
+    input_report_allocations++;
+
+    return IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, length);
+}
+
+void VoodooI2CHIDDevice::releaseInputReportBuffer(IOBufferMemoryDescriptor* buffer) {
+    for (int i = 0; i < I2C_INPUT_REPORT_POOL_SIZE; i++) {
+        if (input_report_pool[i] != buffer)
+            continue;
+
+        UInt32 free;
+        do {
+            free = input_report_pool_free;
+        } while (!OSCompareAndSwap(free, free | (1 << i), &input_report_pool_free));
+
+        return;
+    }
+
     buffer->release();
+}
+
+void VoodooI2CHIDDevice::releaseInputReportPool() {
+    input_report_pool_free = 0;
+
+    for (int i = 0; i < I2C_INPUT_REPORT_POOL_SIZE; i++)
+        OSSafeReleaseNULL(input_report_pool[i]);
+}
+
+void VoodooI2CHIDDevice::inputThreadMain() {
+    IOLockLock(input_thread_lock);
+
+    while (true) {
+        while (!pending_interrupts && !input_thread_should_exit)
+            IOLockSleep(input_thread_lock, &pending_interrupts, THREAD_UNINT);
+
+        if (input_thread_should_exit)
+            break;
+
+        UInt32 pending = pending_interrupts;
+        uint64_t interrupt_time = pending_interrupt_time;
+        pending_interrupts = 0;
+        IOLockUnlock(input_thread_lock);
+
+        // Service every interrupt that was coalesced while we were busy, stopping early
+        // once the device reports that it has nothing left
+
+        while (pending--) {
+            bool got_report = getInputReport(interrupt_time);
+            interrupt_time = 0;
+
+            if (!got_report)
+                break;
+
+            polled_report = true;
+        }
+
+        IOLockLock(input_thread_lock);
+    }
+
+    input_thread_running = false;
+    IOLockWakeup(input_thread_lock, &input_thread_running, false);
+    IOLockUnlock(input_thread_lock);
 
-exit:
-    read_in_progress = false;
     thread_terminate(current_thread());
 }
 
+void VoodooI2CHIDDevice::acquireBus(bool input) {
+    uint64_t start, end, deadline;
+    bool yield = !input;
+
+    clock_get_uptime(&start);
+    clock_interval_to_deadline(I2C_COMMAND_MAX_YIELD, kMillisecondScale, &deadline);
+
+    IOLockLock(bus_lock);
+
+    // An input read only holds back commands while it waits for the bus, once it has the bus <bus_busy>
+    // does that until the read is done and commands are free to go while the report is being handled
+
+    if (input)
+        input_pending++;
+
+    while (bus_busy || (yield && input_pending)) {
+        if (bus_busy) {
+            IOLockSleep(bus_lock, &bus_busy, THREAD_UNINT);
+            continue;
+        }
+
+        if (IOLockSleepDeadline(bus_lock, &bus_busy, deadline, THREAD_UNINT) == THREAD_TIMED_OUT && input_pending) {
+            command_yield_timeouts++;
+            yield = false;
+        }
+    }
+
+    bus_busy = true;
+
+    if (input)
+        input_pending--;
+
+    IOLockUnlock(bus_lock);
+
+    clock_get_uptime(&end);
+    recordLatency(input ? &input_bus_wait_latency : &command_bus_wait_latency, start, end);
+}
+
+void VoodooI2CHIDDevice::releaseBus() {
+    IOLockLock(bus_lock);
+    bus_busy = false;
+    IOLockWakeup(bus_lock, &bus_busy, false);
+    IOLockUnlock(bus_lock);
+}
+
+IOReturn VoodooI2CHIDDevice::startInputThread() {
+    input_thread_should_exit = false;
+    input_thread_running = true;
+
+    kern_return_t ret = kernel_thread_start(OSMemberFunctionCast(thread_continue_t, this, &VoodooI2CHIDDevice::inputThreadMain), this, &input_thread);
+    if (ret != KERN_SUCCESS) {
+        input_thread_running = false;
+        input_thread = NULL;
+        IOLog("%s::%s Could not create input report thread\n", getName(), name);
+        return kIOReturnError;
+    }
+
+    thread_deallocate(input_thread);
+
+    return kIOReturnSuccess;
+}
+
+void VoodooI2CHIDDevice::stopInputThread() {
+    if (!input_thread)
+        return;
+
+    IOLockLock(input_thread_lock);
+    input_thread_should_exit = true;
+    IOLockWakeup(input_thread_lock, &pending_interrupts, true);
+
+    while (input_thread_running)
+        IOLockSleep(input_thread_lock, &input_thread_running, THREAD_UNINT);
+    IOLockUnlock(input_thread_lock);
+
+    input_thread = NULL;
+}
+
 IOWorkLoop* VoodooI2CHIDDevice::getWorkLoop(void) const {
+    // Do we have a work loop already?, if so return it NOW.
+    if ((vm_address_t) device_work_loop >> 1)
+        return device_work_loop;
+
+    if (OSCompareAndSwapPtr(NULL, reinterpret_cast<void*>(1), reinterpret_cast<void* volatile*>(&device_work_loop))) {
+        IOWorkLoop* loop;
+
+        if (getProperty("SharedWorkLoop") == kOSBooleanTrue) {
+            loop = getSharedWorkLoop();
+            if (loop)
+                loop->retain();
+        } else {
+            loop = IOWorkLoop::workLoop();
+        }
+
+        device_work_loop = loop;
+    } else {
+        while (device_work_loop == reinterpret_cast<IOWorkLoop*>(1)) {
+            // Spin around the device_work_loop variable until the
+            // initialization finishes.
+            thread_block(0);
+        }
+    }
+
+    return device_work_loop;
+}
+
+IOWorkLoop* VoodooI2CHIDDevice::getSharedWorkLoop() {
     static IOWorkLoop* __work_loop = NULL;
 
     // Do we have a work loop already?, if so return it NOW.
     if ((vm_address_t) __work_loop >> 1)
         return __work_loop;
     
-    if (OSCompareAndSwap(0, 1, reinterpret_cast<IOWorkLoop*>(&__work_loop))) {
+    if (OSCompareAndSwapPtr(NULL, reinterpret_cast<void*>(1), reinterpret_cast<void* volatile*>(&__work_loop))) {
         // Construct the workloop and set the __work_loop variable
         // to whatever the result is and return
         __work_loop = IOWorkLoop::workLoop();
@@ -239,6 +680,8 @@ IOReturn VoodooI2CHIDDevice::getReport(IOMemoryDescriptor* report, IOHIDReportTy
     if (reportType != kIOHIDReportTypeFeature && reportType != kIOHIDReportTypeInput)
         return kIOReturnBadArgument;
 
+    waitForReset();
+
     UInt8 args[3];
     IOReturn ret;
     int args_len = 0;
@@ -257,11 +700,17 @@ IOReturn VoodooI2CHIDDevice::getReport(IOMemoryDescriptor* report, IOHIDReportTy
     I2C_LOCK();
 
     UInt8 length = sizeof(VoodooI2CHIDDeviceCommand);
-    UInt8* buffer = (UInt8*) getMallocI2C(report->getLength());
-    memset(buffer, 0, report->getLength());
+    UInt32 report_length = report->getLength();
+    UInt8* buffer = acquireI2CBuffer(&command_arena, report_length);
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) acquireI2CBuffer(&command_arena, length + args_len);
+
+    if (!buffer || !command) {
+        releaseI2CBuffer(&command_arena, (UInt8*)command, length + args_len);
+        releaseI2CBuffer(&command_arena, buffer, report_length);
+        I2C_UNLOCK();
+        return kIOReturnNoResources;
+    }
 
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(length + args_len);
-    memset(command, 0, length + args_len);
     command->c.reg = hid_descriptor->wCommandRegister;
     command->c.opcode = 0x02;
     command->c.report_type_id = report_id | raw_report_type << 4;
@@ -269,8 +718,11 @@ IOReturn VoodooI2CHIDDevice::getReport(IOMemoryDescriptor* report, IOHIDReportTy
     UInt8* raw_command = (UInt8*)command;
     
     memcpy(raw_command + length, args, args_len);
-    ret = api->writeReadI2C(raw_command, length+args_len, buffer, report->getLength());
-    report->writeBytes(0, buffer+2, report->getLength()-2);
+    ret = api->writeReadI2C(raw_command, length+args_len, buffer, report_length);
+    report->writeBytes(0, buffer+2, report_length-2);
+
+    releaseI2CBuffer(&command_arena, (UInt8*)command, length + args_len);
+    releaseI2CBuffer(&command_arena, buffer, report_length);
     
     I2C_UNLOCK();
 
@@ -278,21 +730,23 @@ IOReturn VoodooI2CHIDDevice::getReport(IOMemoryDescriptor* report, IOHIDReportTy
 }
 
 void VoodooI2CHIDDevice::interruptOccured(OSObject* owner, IOInterruptEventSource* src, int intCount) {
-    if (read_in_progress)
-        return;
-    if (!awake)
+    if (!awake) {
+        interrupts_dropped++;
         return;
-    
-    read_in_progress = true;
-
-    thread_t new_thread;
-    kern_return_t ret = kernel_thread_start(OSMemberFunctionCast(thread_continue_t, this, &VoodooI2CHIDDevice::getInputReport), this, &new_thread);
-    if (ret != KERN_SUCCESS) {
-        read_in_progress = false;
-        IOLog("%s::%s Thread error while attempting to get input report\n", getName(), name);
-    } else {
-        thread_deallocate(new_thread);
     }
+
+    // Hand the read over to the input report thread, if it is still busy with an
+    // earlier interrupt then it will pick this one up before going back to sleep
+    
+    IOLockLock(input_thread_lock);
+    interrupts_received++;
+    if (pending_interrupts)
+        interrupts_coalesced++;
+    else
+        clock_get_uptime(&pending_interrupt_time);
+    pending_interrupts++;
+    IOLockWakeup(input_thread_lock, &pending_interrupts, true);
+    IOLockUnlock(input_thread_lock);
 }
 
 VoodooI2CHIDDevice* VoodooI2CHIDDevice::probe(IOService* provider, SInt32* score) {
@@ -328,32 +782,154 @@ VoodooI2CHIDDevice* VoodooI2CHIDDevice::probe(IOService* provider, SInt32* score
         IOLog("%s::%s Could not get HID descriptor\n", getName(), name);
         return NULL;
     }
-    read_in_progress = false;
 
     return this;
 }
 
-void VoodooI2CHIDDevice::releaseResources() {
-    if (command_gate) {
-        work_loop->removeEventSource(command_gate);
-        command_gate->release();
-        command_gate = NULL;
-    }
-    
+void VoodooI2CHIDDevice::publishStatistics() {
+    OSDictionary* statistics = OSDictionary::withCapacity(8);
+
+    if (!statistics)
+        return;
+
+    OSNumber* number = OSNumber::withNumber(interrupts_received, 64);
+    statistics->setObject("InterruptsReceived", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(interrupts_coalesced, 64);
+    statistics->setObject("InterruptsCoalesced", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(interrupts_dropped, 64);
+    statistics->setObject("InterruptsDropped", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(input_report_allocations, 64);
+    statistics->setObject("InputReportAllocations", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(input_arena.high_water_mark, 32);
+    statistics->setObject("InputBufferHighWaterMark", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(input_arena.oversized, 64);
+    statistics->setObject("InputBufferOversized", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(input_arena.busy, 64);
+    statistics->setObject("InputBufferBusy", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(command_arena.high_water_mark, 32);
+    statistics->setObject("CommandBufferHighWaterMark", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(command_arena.oversized, 64);
+    statistics->setObject("CommandBufferOversized", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(command_arena.busy, 64);
+    statistics->setObject("CommandBufferBusy", number);
+    OSSafeReleaseNULL(number);
+
     if (interrupt_simulator) {
+        number = OSNumber::withNumber(polling_interval, 32);
+        statistics->setObject("PollingInterval", number);
+        OSSafeReleaseNULL(number);
+    }
+
+    OSDictionary* histogram = copyLatencyHistogram(&interrupt_to_read_latency);
+    statistics->setObject("InterruptToReadLatency", histogram);
+    OSSafeReleaseNULL(histogram);
+
+    histogram = copyLatencyHistogram(&read_duration_latency);
+    statistics->setObject("ReadDurationLatency", histogram);
+    OSSafeReleaseNULL(histogram);
+
+    histogram = copyLatencyHistogram(&read_to_report_latency);
+    statistics->setObject("ReadToReportLatency", histogram);
+    OSSafeReleaseNULL(histogram);
+
+    histogram = copyLatencyHistogram(&wake_to_report_latency);
+    statistics->setObject("WakeToFirstReportLatency", histogram);
+    OSSafeReleaseNULL(histogram);
+
+    histogram = copyLatencyHistogram(&input_bus_wait_latency);
+    statistics->setObject("InputBusWaitLatency", histogram);
+    OSSafeReleaseNULL(histogram);
+
+    histogram = copyLatencyHistogram(&command_bus_wait_latency);
+    statistics->setObject("CommandBusWaitLatency", histogram);
+    OSSafeReleaseNULL(histogram);
+
+    number = OSNumber::withNumber(command_yield_timeouts, 64);
+    statistics->setObject("CommandYieldTimeouts", number);
+    OSSafeReleaseNULL(number);
+
+    setProperty("VoodooI2CHIDStatistics", statistics);
+    statistics->release();
+}
+
+void VoodooI2CHIDDevice::resetStatistics() {
+    interrupts_received = 0;
+    interrupts_coalesced = 0;
+    interrupts_dropped = 0;
+    input_report_allocations = 0;
+    input_arena.high_water_mark = 0;
+    input_arena.oversized = 0;
+    input_arena.busy = 0;
+    command_arena.high_water_mark = 0;
+    command_arena.oversized = 0;
+    command_arena.busy = 0;
+
+    memset(&interrupt_to_read_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&read_duration_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&read_to_report_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&wake_to_report_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&input_bus_wait_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    memset(&command_bus_wait_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+    command_yield_timeouts = 0;
+}
+
+void VoodooI2CHIDDevice::releaseResources() {
+    // Stop new reads and wait for the input thread before tearing down the gate and the reset
+    // timer, the thread completes resets through the gate
+
+    if (interrupt_simulator)
         interrupt_simulator->disable();
+
+    if (interrupt_source)
+        interrupt_source->disable();
+
+    stopInputThread();
+
+    if (interrupt_simulator) {
         work_loop->removeEventSource(interrupt_simulator);
         interrupt_simulator->release();
         interrupt_simulator = NULL;
     }
 
     if (interrupt_source) {
-        interrupt_source->disable();
         work_loop->removeEventSource(interrupt_source);
         interrupt_source->release();
         interrupt_source = NULL;
     }
 
+    if (reset_timer) {
+        reset_timer->cancelTimeout();
+        work_loop->removeEventSource(reset_timer);
+        reset_timer->release();
+        reset_timer = NULL;
+    }
+
+    if (command_gate) {
+        work_loop->removeEventSource(command_gate);
+        command_gate->release();
+        command_gate = NULL;
+    }
+
+    releaseInputReportPool();
+
     if (work_loop) {
         work_loop->release();
         work_loop = NULL;
@@ -377,43 +953,107 @@ IOReturn VoodooI2CHIDDevice::resetHIDDevice() {
 }
 
 IOReturn VoodooI2CHIDDevice::resetHIDDeviceGated() {
+    IOReturn ret = beginResetGated();
+
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    return waitForResetGated();
+}
+
+IOReturn VoodooI2CHIDDevice::beginReset() {
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::beginResetGated));
+}
+
+IOReturn VoodooI2CHIDDevice::beginResetGated() {
     setHIDPowerState(kVoodooI2CStateOn);
     
     IOSleep(1);
 
+    // The zero-length report can arrive as soon as the command is written
+
+    reset_pending = true;
+    reset_timed_out = false;
+
+    // Device is required to complete a host-initiated reset in at most 5 seconds.
+
+    reset_timer->setTimeoutMS(I2C_HID_RESET_TIMEOUT);
+
     I2C_LOCK();
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(sizeof(VoodooI2CHIDDeviceCommand));
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) acquireI2CBuffer(&command_arena, sizeof(VoodooI2CHIDDeviceCommand));
+    if (!command) {
+        I2C_UNLOCK();
+        reset_timer->cancelTimeout();
+        reset_pending = false;
+        command_gate->commandWakeup(&reset_event);
+        return kIOReturnNoResources;
+    }
     command->c.reg = hid_descriptor->wCommandRegister;
     command->c.opcode = 0x01;
     command->c.report_type_id = 0;
 
     api->writeI2C(command->data, sizeof(VoodooI2CHIDDeviceCommand));
+    releaseI2CBuffer(&command_arena, (UInt8*)command, sizeof(VoodooI2CHIDDeviceCommand));
     I2C_UNLOCK();
-    
-    AbsoluteTime absolute_time, deadline;
 
-    // Device is required to complete a host-initiated reset in at most 5 seconds.
+    return kIOReturnSuccess;
+}
 
-    nanoseconds_to_absolutetime(5000000000, &absolute_time);
-    clock_absolutetime_interval_to_deadline(absolute_time, &deadline);
-    IOReturn sleep = command_gate->commandSleep(&reset_event, deadline, THREAD_ABORTSAFE);
+IOReturn VoodooI2CHIDDevice::completeResetGated() {
+    if (!reset_pending)
+        return kIOReturnSuccess;
 
-    if (sleep == THREAD_TIMED_OUT) {
-        IOLog("%s::%s Timeout waiting for device to complete host initiated reset\n", getName(), name);
-        return kIOReturnTimeout;
-    }
+    reset_timer->cancelTimeout();
+    reset_pending = false;
+    command_gate->commandWakeup(&reset_event);
 
     return kIOReturnSuccess;
 }
 
+void VoodooI2CHIDDevice::resetTimedOut(OSObject* owner, IOTimerEventSource* timer) {
+    if (!reset_pending)
+        return;
+
+    IOLog("%s::%s Timeout waiting for device to complete host initiated reset\n", getName(), name);
+
+    // Let everything that was waiting go ahead, the device may still work without having acknowledged the reset
+
+    reset_timed_out = true;
+    reset_pending = false;
+    command_gate->commandWakeup(&reset_event);
+}
+
+IOReturn VoodooI2CHIDDevice::waitForReset() {
+    // Avoid taking the gate on every transfer once the device is up
+
+    if (!reset_pending || !command_gate)
+        return reset_timed_out ? kIOReturnTimeout : kIOReturnSuccess;
+
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooI2CHIDDevice::waitForResetGated));
+}
+
+IOReturn VoodooI2CHIDDevice::waitForResetGated() {
+    // The reset timer bounds the wait
+
+    while (reset_pending)
+        command_gate->commandSleep(&reset_event, THREAD_UNINT);
+
+    return reset_timed_out ? kIOReturnTimeout : kIOReturnSuccess;
+}
+
 IOReturn VoodooI2CHIDDevice::setHIDPowerState(VoodooI2CState state) {
     I2C_LOCK();
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(sizeof(VoodooI2CHIDDeviceCommand));
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) acquireI2CBuffer(&command_arena, sizeof(VoodooI2CHIDDeviceCommand));
+    if (!command) {
+        I2C_UNLOCK();
+        return kIOReturnNoResources;
+    }
     command->c.reg = hid_descriptor->wCommandRegister;
     command->c.opcode = 0x08;
     command->c.report_type_id = state ? I2C_HID_PWR_ON : I2C_HID_PWR_SLEEP;
     
     IOReturn ret = api->writeI2C(command->data, sizeof(VoodooI2CHIDDeviceCommand));
+    releaseI2CBuffer(&command_arena, (UInt8*)command, sizeof(VoodooI2CHIDDeviceCommand));
     I2C_UNLOCK();
 
     return ret;
@@ -423,61 +1063,62 @@ IOReturn VoodooI2CHIDDevice::setReport(IOMemoryDescriptor* report, IOHIDReportTy
     if (reportType != kIOHIDReportTypeFeature && reportType != kIOHIDReportTypeOutput)
         return kIOReturnBadArgument;
 
+    waitForReset();
+
     UInt16 data_register = hid_descriptor->wDataRegister;
     UInt8 raw_report_type = (reportType == kIOHIDReportTypeFeature) ? 0x03 : 0x02;
-    UInt8 idx = 0;
-    UInt16 size;
-    UInt16 arguments_length;
     UInt8 report_id = options & 0xFF;
-    UInt8* buffer = (UInt8*)IOMalloc(report->getLength());
-    report->readBytes(0, buffer, report->getLength());
-    
+    UInt32 report_length = report->getLength();
+    UInt16 size;
+    UInt32 length;
+
     size = 2 +
     (report_id ? 1 : 0)     /* reportID */ +
-    report->getLength()     /* buf */;
+    report_length           /* buf */;
 
-    arguments_length = (report_id >= 0x0F ? 1 : 0)  /* optional third byte */ +
+    length = sizeof(VoodooI2CHIDDeviceCommand)      /* command */ +
+    (report_id >= 0x0F ? 1 : 0)                     /* optional third byte */ +
     2                                               /* dataRegister */ +
     size                                            /* args */;
-    
-    UInt8* arguments = (UInt8*)IOMalloc(arguments_length);
-    memset(arguments, 0, arguments_length);
-    
+
+    I2C_LOCK();
+
+    // Serialise the command, its arguments and the report straight into the outgoing buffer
+
+    UInt8* raw_command = acquireI2CBuffer(&command_arena, length);
+    if (!raw_command) {
+        I2C_UNLOCK();
+        return kIOReturnNoResources;
+    }
+
+    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*)raw_command;
+    UInt32 idx = sizeof(VoodooI2CHIDDeviceCommand);
+
     if (report_id >= 0x0F) {
-        arguments[idx++] = report_id;
+        raw_command[idx++] = report_id;
         report_id = 0x0F;
     }
-    
-    arguments[idx++] = data_register & 0xFF;
-    arguments[idx++] = data_register >> 8;
-    
-    arguments[idx++] = size & 0xFF;
-    arguments[idx++] = size >> 8;
-    
-    if (report_id)
-        arguments[idx++] = report_id;
-    
-    memcpy(&arguments[idx], buffer, report->getLength());
-    
-    I2C_LOCK();
 
-    UInt8 length = sizeof(VoodooI2CHIDDeviceCommand);
-    VoodooI2CHIDDeviceCommand* command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(length + arguments_length);
-    memset(command, 0, length + arguments_length);
     command->c.reg = hid_descriptor->wCommandRegister;
     command->c.opcode = 0x03;
     command->c.report_type_id = report_id | raw_report_type << 4;
-    
-    UInt8* raw_command = (UInt8*)command;
-    
-    memcpy(raw_command + length, arguments, arguments_length);
-    IOReturn ret = api->writeI2C(raw_command, length+arguments_length);
+
+    raw_command[idx++] = data_register & 0xFF;
+    raw_command[idx++] = data_register >> 8;
+
+    raw_command[idx++] = size & 0xFF;
+    raw_command[idx++] = size >> 8;
+
+    if (report_id)
+        raw_command[idx++] = report_id;
+
+    report->readBytes(0, raw_command + idx, report_length);
+
+    IOReturn ret = api->writeI2C(raw_command, length);
+    releaseI2CBuffer(&command_arena, raw_command, length);
     
     I2C_UNLOCK();
 
-    IOFree(arguments, arguments_length);
-    IOFree(buffer, report->getLength());
-
     return ret;
 }
 
@@ -493,21 +1134,26 @@ IOReturn VoodooI2CHIDDevice::setPowerState(unsigned long whichState, IOService*
         }
     } else {
         if (!awake) {
-            setHIDPowerState(kVoodooI2CStateOn);
-            
-            IOSleep(1);
-            
-            I2C_LOCK();
-            VoodooI2CHIDDeviceCommand *command = (VoodooI2CHIDDeviceCommand*) getMallocI2C(sizeof(VoodooI2CHIDDeviceCommand));
-            command->c.reg = hid_descriptor->wCommandRegister;
-            command->c.opcode = 0x01;
-            command->c.report_type_id = 0;
+            clock_get_uptime(&wake_time);
+
+            // The event drivers verify the state of devices that retain it and reset them if needed
+
+            if (fast_resume) {
+                setHIDPowerState(kVoodooI2CStateOn);
+                refreshHIDDescriptor();
+                IOLog("%s::%s Woke up without reset\n", getName(), name);
+                awake = true;
+                return kIOPMAckImplied;
+            }
+
+            // Interrupts are dropped while we are asleep so we have to be awake before the reset
+            // is sent or its zero-length reply would be lost, the reset powers the device on itself
+
+            awake = true;
             
-            api->writeI2C(command->data, sizeof(VoodooI2CHIDDeviceCommand));
-            I2C_UNLOCK();
+            beginReset();
             
             IOLog("%s::%s Woke up\n", getName(), name);
-            awake = true;
         }
     }
     return kIOPMAckImplied;
@@ -540,6 +1186,20 @@ bool VoodooI2CHIDDevice::handleStart(IOService* provider) {
         IOLog("%s::%s Could not open API\n", getName(), name);
         goto exit;
     }
+
+    if (allocateInputReportPool() != kIOReturnSuccess)
+        goto exit;
+
+    if (startInputThread() != kIOReturnSuccess)
+        goto exit;
+
+    reset_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CHIDDevice::resetTimedOut));
+    if (!reset_timer || (work_loop->addEventSource(reset_timer) != kIOReturnSuccess)) {
+        IOLog("%s::%s Could not create reset timer\n", getName(), name);
+        goto exit;
+    }
+
+    fast_resume = getProperty("FastResume") == kOSBooleanTrue;
     
     interrupt_source = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &VoodooI2CHIDDevice::interruptOccured), api, 0);
     if (!interrupt_source) {
@@ -550,6 +1210,23 @@ bool VoodooI2CHIDDevice::handleStart(IOService* provider) {
             IOLog("%s::%s Could not get timer event source\n", getName(), name);
             goto exit;
         }
+        OSNumber* number = OSDynamicCast(OSNumber, getProperty("PollingIntervalMinimum"));
+        if (number && number->unsigned32BitValue())
+            polling_interval_minimum = number->unsigned32BitValue();
+
+        number = OSDynamicCast(OSNumber, getProperty("PollingIntervalMaximum"));
+        if (number)
+            polling_interval_maximum = number->unsigned32BitValue();
+
+        number = OSDynamicCast(OSNumber, getProperty("PollingIdleThreshold"));
+        if (number)
+            polling_idle_threshold = number->unsigned32BitValue();
+
+        if (polling_interval_maximum < polling_interval_minimum)
+            polling_interval_maximum = polling_interval_minimum;
+
+        polling_interval = polling_interval_maximum;
+
         work_loop->addEventSource(interrupt_simulator);
         interrupt_simulator->setTimeoutMS(200);
     } else {
@@ -557,17 +1234,15 @@ bool VoodooI2CHIDDevice::handleStart(IOService* provider) {
         interrupt_source->enable();
     }
 
-    resetHIDDevice();
+    // Don't wait for the reset here, requests from IOHIDFamily and the event drivers are held
+    // back in <waitForReset> until the device has completed it
 
+    if (beginReset() != kIOReturnSuccess)
+        IOLog("%s::%s Could not reset device\n", getName(), name);
 
     PMinit();
     api->joinPMtree(this);
     registerPowerDriver(this, VoodooI2CIOPMPowerStates, kVoodooI2CIOPMNumberPowerStates);
-    
-    // Give the reset a bit of time so that IOHIDDevice doesnt happen to start requesting the report
-    // descriptor before the driver is ready
-
-    IOSleep(100);
 
     return true;
 exit:
@@ -593,42 +1268,20 @@ void VoodooI2CHIDDevice::stop(IOService* provider) {
 }
 
 IOReturn VoodooI2CHIDDevice::newReportDescriptor(IOMemoryDescriptor** descriptor) const {
-    if (!hid_descriptor->wReportDescLength) {
-        IOLog("%s::%s Invalid report descriptor size\n", getName(), name);
-        return kIOReturnDeviceError;
-    }
+    // A reset in progress may still change the HID descriptor that the cached report descriptor is checked against
 
-    I2C_LOCK();
+    const_cast<VoodooI2CHIDDevice*>(this)->waitForReset();
 
-    VoodooI2CHIDDeviceCommand command;
-    command.c.reg = hid_descriptor->wReportDescRegister;
-    
-    UInt8* buffer = reinterpret_cast<UInt8*>(IOMalloc(hid_descriptor->wReportDescLength));
-    memset(buffer, 0, hid_descriptor->wReportDescLength);
+    if (!report_descriptor || report_descriptor_length != hid_descriptor->wReportDescLength || report_descriptor_version != hid_descriptor->wVersionID) {
+        IOReturn ret = const_cast<VoodooI2CHIDDevice*>(this)->getReportDescriptor();
 
-    if (api->writeReadI2C(command.data, 2, buffer, hid_descriptor->wReportDescLength) != kIOReturnSuccess) {
-        I2C_UNLOCK();
-        IOFree(buffer, hid_descriptor->wReportDescLength);
-        IOLog("%s::%s Could not get report descriptor\n", getName(), name);
-        return kIOReturnIOError;
-    }
-
-    IOBufferMemoryDescriptor* report_descriptor = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, hid_descriptor->wReportDescLength);
-
-    if (!report_descriptor) {
-        I2C_UNLOCK();
-        IOFree(buffer, hid_descriptor->wReportDescLength);
-        IOLog("%s::%s Could not allocated buffer for report descriptor\n", getName(), name);
-        return kIOReturnNoResources;
+        if (ret != kIOReturnSuccess)
+            return ret;
     }
 
-    report_descriptor->writeBytes(0, buffer, hid_descriptor->wReportDescLength);
+    report_descriptor->retain();
     *descriptor = report_descriptor;
 
-    I2C_UNLOCK();
-
-    IOFree(buffer, hid_descriptor->wReportDescLength);
-
     return kIOReturnSuccess;
 }
 
@@ -652,7 +1305,46 @@ OSString* VoodooI2CHIDDevice::newManufacturerString() const {
     return OSString::withCString("Apple");
 }
 
+IOReturn VoodooI2CHIDDevice::setProperties(OSObject* properties) {
+    OSDictionary* dict = OSDynamicCast(OSDictionary, properties);
+
+    if (dict) {
+        OSBoolean* reset = OSDynamicCast(OSBoolean, dict->getObject("ResetStatistics"));
+
+        if (reset && reset->isTrue()) {
+            IOLog("%s::%s Resetting statistics\n", getName(), name);
+            resetStatistics();
+        }
+    }
+
+    return super::setProperties(properties);
+}
+
+bool VoodooI2CHIDDevice::serializeProperties(OSSerialize* serializer) const {
+    // The counters are only turned into registry objects when somebody asks for them
+    // so that the input path does not have to allocate
+    
+    const_cast<VoodooI2CHIDDevice*>(this)->publishStatistics();
+
+    return super::serializeProperties(serializer);
+}
+
 void VoodooI2CHIDDevice::simulateInterrupt(OSObject* owner, IOTimerEventSource* timer) {
+    // The reads triggered by earlier polls tell us whether the device is active
+
+    if (polled_report) {
+        polled_report = false;
+        polling_idle_count = 0;
+        polling_interval = polling_interval_minimum;
+    } else if (polling_idle_count < polling_idle_threshold) {
+        polling_idle_count++;
+    } else if (polling_interval < polling_interval_maximum) {
+        polling_interval *= 2;
+
+        if (polling_interval > polling_interval_maximum)
+            polling_interval = polling_interval_maximum;
+    }
+
     interruptOccured(owner, NULL, NULL);
-    interrupt_simulator->setTimeoutMS(INTERRUPT_SIMULATOR_TIMEOUT);
+    interrupt_simulator->setTimeoutUS(polling_interval);
 }
@@ -15,19 +15,29 @@
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 #include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/hid/IOHIDDevice.h>
 #include <IOKit/hid/IOHIDElement.h>
 #include "../../../Dependencies/helpers.hpp"
 
-#define INTERRUPT_SIMULATOR_TIMEOUT 5
+// Defaults for the adaptive interrupt simulator, overridable through the personality
+
+#define INTERRUPT_SIMULATOR_MIN_INTERVAL        1000    // us, used while the device is reporting
+#define INTERRUPT_SIMULATOR_MAX_INTERVAL        200000  // us, ceiling when the device is idle
+#define INTERRUPT_SIMULATOR_IDLE_THRESHOLD      100     // empty polls before backing off
+
+#define I2C_HID_RESET_TIMEOUT   5000    // ms, the longest a device may take to complete a host-initiated reset
 
 #define I2C_HID_PWR_ON  0x00
 #define I2C_HID_PWR_SLEEP 0x01
 
 #define I2C_MAX_BUF_SIZE            0x400
-#define I2C_LOCK()                  IOLockLock(read_in_progress_mutex)
-#define I2C_UNLOCK()                IOLockUnlock(read_in_progress_mutex)
-#define I2C_TRYLOCK()               IOLockTryLock(read_in_progress_mutex)
+#define I2C_INPUT_REPORT_POOL_SIZE  1       // reports are only read and handled on the input thread, one at a time
+#define LATENCY_HISTOGRAM_BUCKETS   24
+#define I2C_COMMAND_MAX_YIELD       10      // ms, the longest a command waits for input reads to finish
+#define I2C_LOCK()                  acquireBus(false)
+#define I2C_INPUT_LOCK()            acquireBus(true)
+#define I2C_UNLOCK()                releaseBus()
 
 typedef union {
     UInt8 data[4];
@@ -55,6 +65,98 @@ typedef struct __attribute__((__packed__)) {
     UInt32 reserved;
 } VoodooI2CHIDDeviceHIDDescriptor;
 
+/* Bounded arena from which the buffers for <api->readI2C>, <api->writeI2C> and <api->writeReadI2C> are taken
+ *
+ * Slices are handed out from the front of <pool> and the arena only rewinds once every slice has been released,
+ * so a buffer is never reused while a transfer may still be using it. Requests that do not fit are served from
+ * the heap, counted in <oversized> if they are larger than the arena and in <busy> if the slices still in use
+ * leave no room for them.
+ */
+
+typedef struct {
+    UInt8*  pool;
+    UInt32  offset;
+    UInt32  outstanding;
+    UInt32  high_water_mark;
+    UInt64  oversized;
+    UInt64  busy;
+} VoodooI2CHIDDeviceBufferArena;
+
+/* Histogram of latencies on a log2 scale
+ *
+ * Bucket 0 counts samples below 1us and bucket n counts samples in [2^(n-1), 2^n) us, the last bucket also
+ * counts everything above its range.
+ */
+
+typedef struct {
+    UInt32 buckets[LATENCY_HISTOGRAM_BUCKETS];
+    UInt64 count;
+    UInt64 maximum;
+} VoodooI2CHIDLatencyHistogram;
+
+/* Records the time elapsed between two absolute times in a histogram
+ * @histogram The histogram to update
+ * @start The absolute time at which the interval started
+ * @end The absolute time at which the interval ended
+ */
+
+static inline void recordLatency(VoodooI2CHIDLatencyHistogram* histogram, uint64_t start, uint64_t end) {
+    uint64_t elapsed_ns;
+
+    if (end <= start)
+        elapsed_ns = 0;
+    else
+        absolutetime_to_nanoseconds(end - start, &elapsed_ns);
+
+    uint64_t elapsed_us = elapsed_ns / 1000;
+    UInt32 bucket = elapsed_us ? 64 - __builtin_clzll(elapsed_us) : 0;
+
+    if (bucket >= LATENCY_HISTOGRAM_BUCKETS)
+        bucket = LATENCY_HISTOGRAM_BUCKETS - 1;
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+
+    if (elapsed_us > histogram->maximum)
+        histogram->maximum = elapsed_us;
+}
+
+/* Creates a registry representation of a histogram
+ * @histogram The histogram to serialise
+ *
+ * @return A dictionary containing the sample count, the maximum in us and the bucket counts. The caller must release it.
+ */
+
+static inline OSDictionary* copyLatencyHistogram(const VoodooI2CHIDLatencyHistogram* histogram) {
+    OSDictionary* dictionary = OSDictionary::withCapacity(3);
+    OSArray* buckets = OSArray::withCapacity(LATENCY_HISTOGRAM_BUCKETS);
+
+    if (!dictionary || !buckets) {
+        OSSafeReleaseNULL(dictionary);
+        OSSafeReleaseNULL(buckets);
+        return NULL;
+    }
+
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        OSNumber* number = OSNumber::withNumber(histogram->buckets[i], 32);
+        buckets->setObject(number);
+        OSSafeReleaseNULL(number);
+    }
+
+    OSNumber* number = OSNumber::withNumber(histogram->count, 64);
+    dictionary->setObject("Count", number);
+    OSSafeReleaseNULL(number);
+
+    number = OSNumber::withNumber(histogram->maximum, 64);
+    dictionary->setObject("Maximum", number);
+    OSSafeReleaseNULL(number);
+
+    dictionary->setObject("Buckets", buckets);
+    buckets->release();
+
+    return dictionary;
+}
+
 class VoodooI2CDeviceNub;
 
 /* Implements an I2C-HID device as specified by Microsoft's protocol in the following document: http://download.microsoft.com/download/7/D/D/7DD44BB7-2A7A-4505-AC1C-7227D3D96D5B/hid-over-i2c-protocol-spec-v1-0.docx
@@ -69,6 +171,32 @@ class VoodooI2CHIDDevice : public IOHIDDevice {
  public:
     const char* name;
 
+    /* Whether the host-initiated reset is skipped on wake
+     *
+     * Set through the *FastResume* property for devices that are known to retain their state across sleep. Event
+     * drivers are then responsible for checking that state and calling <resetHIDDevice> if it was lost.
+     */
+
+    bool fast_resume;
+
+    /* Issues an I2C-HID reset command and waits for the device to complete it.
+     *
+     * @return *kIOReturnSuccess* on successful reset, *kIOReturnTimeout* otherwise
+     */
+
+    IOReturn resetHIDDevice();
+
+    /* Issues an I2C-HID reset command without waiting for the device to complete it
+     *
+     * The reset completes when the device sends a zero-length input report or after *I2C_HID_RESET_TIMEOUT*,
+     * whichever comes first. Transfers issued by IOHIDFamily or the event drivers wait for the reset to complete
+     * in <waitForReset>.
+     *
+     * @return *kIOReturnSuccess* if the reset command was sent, an error code otherwise
+     */
+
+    IOReturn beginReset();
+
     /* Initialises a <VoodooI2CHIDDevice> object
      * @properties Contains the properties of the matched provider
      *
@@ -95,6 +223,23 @@ class VoodooI2CHIDDevice : public IOHIDDevice {
      */
     virtual IOReturn getHIDDescriptor();
 
+    /* Reads the HID descriptor again after a reset or a wake without one, keeping the previous one if the read fails
+     *
+     * A report descriptor length or version that no longer matches the cached report descriptor makes
+     * <newReportDescriptor> fetch it again.
+     */
+
+    void refreshHIDDescriptor();
+
+    /* Returns the work loop of the device
+     *
+     * Every device gets its own work loop, created on first use, so that a slow transfer on one device does not
+     * hold up the others. Setting the *SharedWorkLoop* property makes the device use a single work loop shared
+     * with every other device that sets it.
+     *
+     * @return The work loop, or NULL if it could not be created
+     */
+
     IOWorkLoop* getWorkLoop(void) const override;
 
     /*
@@ -104,11 +249,30 @@ class VoodooI2CHIDDevice : public IOHIDDevice {
      */
 
     IOReturn getHIDDescriptorAddress();
+
+    /*
+     * Issues an I2C-HID command to get the report descriptor from the device and caches it
+     *
+     * This is called the first time IOHIDFamily asks for the report descriptor, once the initial reset has completed,
+     * and again only if the HID descriptor reports a different version or report descriptor length.
+     *
+     * @return *kIOReturnSuccess* on sucessfully getting the report descriptor, *kIOReturnIOError* if the request failed, *kIOReturnInvalid* if the descriptor is invalid
+     */
+
+    virtual IOReturn getReportDescriptor();
     
     IOReturn getReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options);
     
     IOReturn parseHIDDescriptor();
 
+    /* Validates a report descriptor and makes it the cached report descriptor
+     * @descriptor The report descriptor, ownership is transferred to this function
+     *
+     * @return *kIOReturnSuccess* if the descriptor is valid, *kIOReturnInvalid* otherwise
+     */
+
+    IOReturn parseReportDescriptor(IOBufferMemoryDescriptor* descriptor);
+
     /* Probes the candidate I2C-HID device to see if this driver can indeed drive it
      * @provider The provider which we have matched against
      * @score    Probe score as specified in the matched personality
@@ -132,6 +296,14 @@ class VoodooI2CHIDDevice : public IOHIDDevice {
 
     bool handleStart(IOService* provider);
     
+    /* Polls the device in place of an interrupt for devices that have no usable interrupt line
+     * @owner The owner of the timer
+     * @timer The timer that fired
+     *
+     * The polling interval is kept at *PollingIntervalMinimum* while the device returns reports. After
+     * *PollingIdleThreshold* consecutive empty polls it doubles with every poll up to *PollingIntervalMaximum*.
+     */
+
     void simulateInterrupt(OSObject* owner, IOTimerEventSource* timer);
     
     /* Sets a few properties that are needed after <IOHIDDevice> finishes starting
@@ -151,9 +323,12 @@ class VoodooI2CHIDDevice : public IOHIDDevice {
 
     void stop(IOService* provider);
 
-    /* Create and return a new memory descriptor that describes the report descriptor for the HID device
+    /* Return a memory descriptor that describes the report descriptor for the HID device
      * @descriptor Pointer to the memory descriptor returned. This memory descriptor will be released by the caller.
      *
+     * The cached report descriptor is returned with an additional reference, it is only fetched from the device
+     * again if the HID descriptor has changed since it was cached.
+     *
      * @return *kIOReturnSuccess* on success, or an error return otherwise.
      */
 
@@ -200,12 +375,7 @@ class VoodooI2CHIDDevice : public IOHIDDevice {
     
     IOReturn resetHIDDeviceGated();
 
-    /* Issues an I2C-HID reset command.
-     *
-     * @return *kIOReturnSuccess* on successful reset, *kIOReturnTimeout* otherwise
-     */
-
-    IOReturn resetHIDDevice();
+    IOReturn beginResetGated();
 
     /* Issues an I2C-HID power state command.
      * @state The power state that the device should enter
@@ -237,35 +407,193 @@ class VoodooI2CHIDDevice : public IOHIDDevice {
     IOReturn setReport(IOMemoryDescriptor* report, IOHIDReportType reportType, IOOptionBits options);
 
  private:
+    /* The cached report descriptor along with the HID descriptor fields it was fetched for
+     */
+
+    IOBufferMemoryDescriptor* report_descriptor;
+    UInt16 report_descriptor_length;
+    UInt16 report_descriptor_version;
+    UInt32 report_descriptor_checksum;
+
     IOACPIPlatformDevice* acpi_device;
     VoodooI2CDeviceNub* api;
     IOCommandGate* command_gate;
     UInt16 hid_descriptor_register;
     IOTimerEventSource* interrupt_simulator;
+    UInt32 polling_interval;
+    UInt32 polling_interval_minimum;
+    UInt32 polling_interval_maximum;
+    UInt32 polling_idle_threshold;
+    UInt32 polling_idle_count;
+    volatile bool polled_report;
     IOInterruptEventSource* interrupt_source;
     bool ready_for_input;
     bool reset_event;
+
+    /* State of the host-initiated reset
+     *
+     * <reset_pending> is only modified with the command gate held and <reset_event> is signalled whenever it is cleared.
+     */
+
+    volatile bool reset_pending;
+    bool reset_timed_out;
+    IOTimerEventSource* reset_timer;
     IOWorkLoop* work_loop;
-    bool read_in_progress;
-    IOLock* read_in_progress_mutex;
+    mutable IOWorkLoop* volatile device_work_loop;
+
+    /* Arbitration of the bus between input reads and command transfers
+     *
+     * <bus_busy> is set while a transfer is in progress and <input_pending> while an input read is waiting
+     * for the bus. Both are protected by <bus_lock>. Commands yield to pending input for at most
+     * *I2C_COMMAND_MAX_YIELD* so that they are not starved by a device that reports continuously.
+     */
+
+    IOLock* bus_lock;
+    bool bus_busy;
+    UInt32 input_pending;
+    UInt64 command_yield_timeouts;
+    VoodooI2CHIDLatencyHistogram input_bus_wait_latency;
+    VoodooI2CHIDLatencyHistogram command_bus_wait_latency;
+
+    /* State shared between <interruptOccured> and the input report thread
+     *
+     * The thread is created once in <handleStart> and sleeps on <input_thread_lock>
+     * until an interrupt is signalled, rather than a new thread being spawned per interrupt.
+     */
+
+    IOLock* input_thread_lock;
+    thread_t input_thread;
+    bool input_thread_running;
+    bool input_thread_should_exit;
+
+    /* Number of interrupts signalled since the input report thread last woke up
+     *
+     * Interrupts that arrive while a read is in flight are accumulated here instead of being dropped
+     * so that the thread keeps reading until it has serviced all of them.
+     */
+
+    UInt32 pending_interrupts;
+    uint64_t pending_interrupt_time;
+
+    /* Interrupt statistics published under the *VoodooI2CHIDStatistics* property
+     */
+
+    UInt64 interrupts_received;
+    UInt64 interrupts_coalesced;
+    UInt64 interrupts_dropped;
+    UInt64 input_report_allocations;
+
+    /* Latencies of the input path published under the *VoodooI2CHIDStatistics* property
+     *
+     * @interrupt_to_read From the interrupt being signalled to the read starting
+     * @read_duration Time spent in <api->readI2C>
+     * @read_to_report From the end of the read to <handleReport> returning
+     */
+
+    VoodooI2CHIDLatencyHistogram interrupt_to_read_latency;
+    VoodooI2CHIDLatencyHistogram read_duration_latency;
+    VoodooI2CHIDLatencyHistogram read_to_report_latency;
+
+    /* The absolute time at which the device was last powered on, cleared once the first report after wake is handled
+     */
+
+    uint64_t wake_time;
+    VoodooI2CHIDLatencyHistogram wake_to_report_latency;
+
+    /* Input report descriptors handed to <handleReport>
+     *
+     * The descriptors are sized from *wMaxInputLength* and allocated once in <handleStart>. A set bit in
+     * <input_report_pool_free> marks the descriptor at that index as available. A device without input reports
+     * gets no pool.
+     */
+
+    IOBufferMemoryDescriptor* input_report_pool[I2C_INPUT_REPORT_POOL_SIZE];
+    volatile UInt32 input_report_pool_free;
+
+    /* Allocates the input report pool
+     *
+     * @return *kIOReturnSuccess* on success or if the device has no input reports, *kIOReturnNoResources* if a descriptor could not be allocated
+     */
+
+    IOReturn allocateInputReportPool();
+
+    /* Takes a descriptor out of the input report pool
+     * @length The length of the report that will be written into the descriptor
+     *
+     * Falls back to allocating a new descriptor should the pool be exhausted.
+     *
+     * @return A descriptor of length *length* or NULL if none could be allocated
+     */
+
+    IOBufferMemoryDescriptor* acquireInputReportBuffer(IOByteCount length);
+
+    /* Returns a descriptor obtained through <acquireInputReportBuffer>
+     * @buffer The descriptor to be returned
+     */
+
+    void releaseInputReportBuffer(IOBufferMemoryDescriptor* buffer);
+
+    /* Frees the input report pool
+     */
+
+    void releaseInputReportPool();
     
     /* Buffers for <api->readI2C>, <api->writeI2C>, <api->writeReadI2C>
      *
-     * Since the functions may use the buffers even after the end of calls,
-     * the buffers need to be kept after calls.
+     * Every buffer is acquired and released under the bus lock within a single call, so a slice is
+     * free to be reused as soon as it is released. Input reads and commands draw from separate arenas.
      */
     
-    UInt16 buf_i2c_cnt_intr, buf_i2c_cnt;
-    UInt8* buf_i2c_pool_intr, *buf_i2c_pool;
-    UInt8* getMallocI2CIntr(UInt16 size);
-    UInt8* getMallocI2C(UInt16 size);
+    VoodooI2CHIDDeviceBufferArena input_arena;
+    VoodooI2CHIDDeviceBufferArena command_arena;
+
+    /* Takes a buffer out of an arena
+     * @arena The arena to allocate from
+     * @size The size of the buffer in bytes
+     *
+     * @return A zeroed buffer of at least *size* bytes, or NULL if the request overflowed the arena and could not be served from the heap
+     */
+
+    UInt8* acquireI2CBuffer(VoodooI2CHIDDeviceBufferArena* arena, UInt32 size);
+
+    /* Returns a buffer obtained through <acquireI2CBuffer>
+     * @arena The arena the buffer was taken from
+     * @buffer The buffer to be released
+     * @size The size that was requested when the buffer was acquired
+     */
+
+    void releaseI2CBuffer(VoodooI2CHIDDeviceBufferArena* arena, UInt8* buffer, UInt32 size);
 
     /* Queries the I2C-HID device for an input report
      *
-     * This function is called from the interrupt handler in a new thread. It is thus not called from interrupt context.
+     * This function is called from the input report thread. It is thus not called from interrupt context.
+     *
+     * @interrupt_time The absolute time at which the interrupt was signalled, or 0 if the read was not directly triggered by an interrupt
+     *
+     * @return *true* if the device returned a non-empty report, *false* if it had nothing to report or the read failed
+     */
+
+    bool getInputReport(uint64_t interrupt_time);
+
+    /* Main loop of the long-lived input report thread
+     *
+     * Sleeps until <interruptOccured> signals that the device has asserted its interrupt line
+     * and then calls <getInputReport>. Returns when <stopInputThread> is called.
      */
 
-    void getInputReport();
+    void inputThreadMain();
+
+    /* Creates the input report thread
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnError* if the thread could not be created
+     */
+
+    IOReturn startInputThread();
+
+    /* Asks the input report thread to exit and waits until it has done so
+     */
+
+    void stopInputThread();
 
     /*
     * This function is called when the I2C-HID device asserts its interrupt line.
@@ -280,6 +608,74 @@ class VoodooI2CHIDDevice : public IOHIDDevice {
      */
 
     void releaseResources();
+
+    /* Refreshes the *VoodooI2CHIDStatistics* property from the live counters
+     */
+
+    void publishStatistics();
+
+    /* Waits for the bus to become free and claims it
+     * @input *true* for input reads, *false* for command transfers
+     *
+     * Input reads are served as soon as the bus is free. Command transfers additionally wait, up to
+     * *I2C_COMMAND_MAX_YIELD*, for the input report thread to finish servicing pending interrupts.
+     */
+
+    void acquireBus(bool input);
+
+    /* Releases the bus claimed by <acquireBus>
+     */
+
+    void releaseBus();
+
+    /* Returns the work loop used by every device that sets *SharedWorkLoop*, creating it on first use
+     */
+
+    static IOWorkLoop* getSharedWorkLoop();
+
+    /* Called once the device has sent the zero-length input report that completes a reset
+     */
+
+    IOReturn completeResetGated();
+
+    /* Called if the device did not complete a reset within *I2C_HID_RESET_TIMEOUT*
+     * @owner The owner of the timer
+     * @timer The timer that fired
+     */
+
+    void resetTimedOut(OSObject* owner, IOTimerEventSource* timer);
+
+    /* Blocks until any pending reset has completed or timed out
+     *
+     * @return *kIOReturnSuccess* if the device is ready, *kIOReturnTimeout* if the last reset timed out
+     */
+
+    IOReturn waitForReset();
+
+    IOReturn waitForResetGated();
+
+    /* Clears all the counters and histograms published under the *VoodooI2CHIDStatistics* property
+     */
+
+    void resetStatistics();
+
+    /* Used to pass user preferences from user mode to the driver
+     * @properties OSDictionary of configured properties
+     *
+     * Setting *ResetStatistics* clears the statistics.
+     *
+     * @return kIOReturnSuccess if the properties are received successfully, otherwise kIOUnsupported
+     */
+
+    IOReturn setProperties(OSObject* properties) override;
+
+    /* Publishes up to date statistics before the registry is serialised
+     * @serializer The serializer the properties are written to
+     *
+     * @return *true* on success, *false* otherwise
+     */
+
+    bool serializeProperties(OSSerialize* serializer) const override;
 };
 
 
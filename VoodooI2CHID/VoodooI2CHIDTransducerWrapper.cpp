@@ -18,6 +18,10 @@ bool VoodooI2CHIDTransducerWrapper::init() {
     transducers = OSArray::withCapacity(4);
     if (!transducers)
         return false;
+
+    fields = NULL;
+    field_count = 0;
+    field_capacity = 0;
     
     return true;
 }
@@ -27,9 +31,188 @@ void VoodooI2CHIDTransducerWrapper::free() {
         transducers->flushCollection();
     OSSafeReleaseNULL(transducers);
 
+    if (fields) {
+        IOFree(fields, field_capacity * sizeof(VoodooI2CHIDTransducerField));
+        fields = NULL;
+    }
+
     super::free();
 }
 
+IOReturn VoodooI2CHIDTransducerWrapper::appendField(IOHIDElement* element, VoodooI2CDigitiserTransducer* transducer, VoodooI2CHIDTransducerFieldTarget target, UInt32 bit) {
+    if (field_count == field_capacity) {
+        UInt32 capacity = field_capacity ? field_capacity * 2 : 16;
+        VoodooI2CHIDTransducerField* grown = reinterpret_cast<VoodooI2CHIDTransducerField*>(IOMalloc(capacity * sizeof(VoodooI2CHIDTransducerField)));
+
+        if (!grown)
+            return kIOReturnNoMemory;
+
+        if (fields) {
+            memcpy(grown, fields, field_count * sizeof(VoodooI2CHIDTransducerField));
+            IOFree(fields, field_capacity * sizeof(VoodooI2CHIDTransducerField));
+        }
+
+        fields = grown;
+        field_capacity = capacity;
+    }
+
+    VoodooI2CHIDTransducerField* field = &fields[field_count++];
+    field->element = element;
+    field->transducer = transducer;
+    field->report_id = element ? element->getReportID() : 0;
+    field->target = target;
+    field->bit = bit;
+
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooI2CHIDTransducerWrapper::addTransducer(VoodooI2CDigitiserTransducer* transducer) {
+    if (!transducer)
+        return kIOReturnBadArgument;
+
+    transducers->setObject(transducer);
+
+    if (!transducer->collection)
+        return kIOReturnSuccess;
+
+    OSArray* child_elements = transducer->collection->getChildElements();
+
+    if (!child_elements)
+        return kIOReturnSuccess;
+
+    bool is_stylus = OSDynamicCast(VoodooI2CDigitiserStylus, transducer) != NULL;
+    bool has_confidence = false;
+    UInt32 begin = field_count;
+
+    if (appendField(NULL, transducer, kVoodooI2CHIDTransducerFieldBegin, 0) != kIOReturnSuccess)
+        return kIOReturnNoMemory;
+
+    for (int i = 0; i < child_elements->getCount(); i++) {
+        IOHIDElement* element = OSDynamicCast(IOHIDElement, child_elements->getObject(i));
+        VoodooI2CHIDTransducerFieldTarget target;
+        UInt32 bit = 0;
+
+        if (!element)
+            continue;
+
+        UInt32 usage = element->getUsage();
+
+        switch (element->getUsagePage()) {
+            case kHIDPage_GenericDesktop:
+                switch (usage) {
+                    case kHIDUsage_GD_X:
+                        transducer->logical_max_x = element->getLogicalMax();
+                        target = kVoodooI2CHIDTransducerFieldX;
+                        break;
+                    case kHIDUsage_GD_Y:
+                        transducer->logical_max_y = element->getLogicalMax();
+                        target = kVoodooI2CHIDTransducerFieldY;
+                        break;
+                    case kHIDUsage_GD_Z:
+                        transducer->logical_max_z = element->getLogicalMax();
+                        target = kVoodooI2CHIDTransducerFieldZ;
+                        break;
+                    default:
+                        continue;
+                }
+                break;
+            case kHIDPage_Button:
+                // Usage 0 means no button and the button state only has room for 32 of them
+
+                if (!usage || usage > 32)
+                    continue;
+
+                target = kVoodooI2CHIDTransducerFieldButton;
+                bit = usage - 1;
+                break;
+            case kHIDPage_Digitizer:
+                switch (usage) {
+                    case kHIDUsage_Dig_TransducerIndex:
+                    case kHIDUsage_Dig_ContactIdentifier:
+                        target = kVoodooI2CHIDTransducerFieldIdentifier;
+                        break;
+                    case kHIDUsage_Dig_Touch:
+                    case kHIDUsage_Dig_TipSwitch:
+                        target = kVoodooI2CHIDTransducerFieldTipSwitch;
+                        break;
+                    case kHIDUsage_Dig_InRange:
+                        target = kVoodooI2CHIDTransducerFieldInRange;
+                        break;
+                    case kHIDUsage_Dig_TipPressure:
+                    case kHIDUsage_Dig_SecondaryTipSwitch:
+                        transducer->pressure_physical_max = element->getPhysicalMax();
+                        target = kVoodooI2CHIDTransducerFieldTipPressure;
+                        break;
+                    case kHIDUsage_Dig_XTilt:
+                        target = kVoodooI2CHIDTransducerFieldXTilt;
+                        break;
+                    case kHIDUsage_Dig_YTilt:
+                        target = kVoodooI2CHIDTransducerFieldYTilt;
+                        break;
+                    case kHIDUsage_Dig_Azimuth:
+                        target = kVoodooI2CHIDTransducerFieldAzimuth;
+                        break;
+                    case kHIDUsage_Dig_Altitude:
+                        target = kVoodooI2CHIDTransducerFieldAltitude;
+                        break;
+                    case kHIDUsage_Dig_Twist:
+                        target = kVoodooI2CHIDTransducerFieldTwist;
+                        break;
+                    case kHIDUsage_Dig_Width:
+                        target = kVoodooI2CHIDTransducerFieldWidth;
+                        break;
+                    case kHIDUsage_Dig_Height:
+                        target = kVoodooI2CHIDTransducerFieldHeight;
+                        break;
+                    case kHIDUsage_Dig_DataValid:
+                    case kHIDUsage_Dig_TouchValid:
+                    case kHIDUsage_Dig_Quality:
+                        has_confidence = true;
+                        target = kVoodooI2CHIDTransducerFieldConfidence;
+                        break;
+                    case kHIDUsage_Dig_BarrelPressure:
+                        target = kVoodooI2CHIDTransducerFieldBarrelPressure;
+                        break;
+                    case kHIDUsage_Dig_BarrelSwitch:
+                        target = kVoodooI2CHIDTransducerFieldBarrelSwitch;
+                        break;
+                    case kHIDUsage_Dig_BatteryStrength:
+                        target = kVoodooI2CHIDTransducerFieldBatteryStrength;
+                        break;
+                    case kHIDUsage_Dig_Eraser:
+                        target = kVoodooI2CHIDTransducerFieldEraser;
+                        break;
+                    case kHIDUsage_Dig_Invert:
+                        target = kVoodooI2CHIDTransducerFieldInvert;
+                        break;
+                    default:
+                        continue;
+                }
+
+                // These only exist on styluses
+
+                if (!is_stylus && target >= kVoodooI2CHIDTransducerFieldBarrelPressure)
+                    continue;
+
+                break;
+            default:
+                continue;
+        }
+
+        if (appendField(element, transducer, target, bit) != kIOReturnSuccess)
+            return kIOReturnNoMemory;
+    }
+
+    fields[begin].bit = has_confidence;
+
+    // The transducer is reported alongside its first element
+
+    if (begin + 1 < field_count)
+        fields[begin].report_id = fields[begin + 1].report_id;
+
+    return kIOReturnSuccess;
+}
+
 VoodooI2CHIDTransducerWrapper* VoodooI2CHIDTransducerWrapper::wrapper() {
     VoodooI2CHIDTransducerWrapper* wrapper = NULL;
     
@@ -42,7 +225,6 @@ VoodooI2CHIDTransducerWrapper* VoodooI2CHIDTransducerWrapper::wrapper() {
         wrapper = NULL;
         goto exit;
     }
-    wrapper->transducers = OSArray::withCapacity(4);
     
 exit:
     return wrapper;
@@ -14,8 +14,57 @@
 #include <IOKit/IOService.h>
 
 #include <IOKit/hid/IOHIDElement.h>
+#include <IOKit/hid/IOHIDUsageTables.h>
 
 #include "../../../Multitouch Support/VoodooI2CDigitiserTransducer.hpp"
+#include "../../../Multitouch Support/VoodooI2CDigitiserStylus.hpp"
+
+/* The transducer member that a compiled field is decoded into
+ */
+
+typedef enum {
+    kVoodooI2CHIDTransducerFieldBegin = 0,
+    kVoodooI2CHIDTransducerFieldX,
+    kVoodooI2CHIDTransducerFieldY,
+    kVoodooI2CHIDTransducerFieldZ,
+    kVoodooI2CHIDTransducerFieldButton,
+    kVoodooI2CHIDTransducerFieldIdentifier,
+    kVoodooI2CHIDTransducerFieldTipSwitch,
+    kVoodooI2CHIDTransducerFieldInRange,
+    kVoodooI2CHIDTransducerFieldTipPressure,
+    kVoodooI2CHIDTransducerFieldXTilt,
+    kVoodooI2CHIDTransducerFieldYTilt,
+    kVoodooI2CHIDTransducerFieldAzimuth,
+    kVoodooI2CHIDTransducerFieldAltitude,
+    kVoodooI2CHIDTransducerFieldTwist,
+    kVoodooI2CHIDTransducerFieldWidth,
+    kVoodooI2CHIDTransducerFieldHeight,
+    kVoodooI2CHIDTransducerFieldConfidence,
+    kVoodooI2CHIDTransducerFieldBarrelPressure,
+    kVoodooI2CHIDTransducerFieldBarrelSwitch,
+    kVoodooI2CHIDTransducerFieldBatteryStrength,
+    kVoodooI2CHIDTransducerFieldEraser,
+    kVoodooI2CHIDTransducerFieldInvert
+} VoodooI2CHIDTransducerFieldTarget;
+
+/* A transducer element resolved once when the wrapper is built
+ *
+ * @element The element whose value is decoded, NULL for *kVoodooI2CHIDTransducerFieldBegin*
+ * @transducer The transducer the value is written to
+ * @report_id The report ID of the element
+ * @target What the value is decoded into
+ * @bit The button bit for *kVoodooI2CHIDTransducerFieldButton*, whether the transducer reports confidence for *kVoodooI2CHIDTransducerFieldBegin*
+ *
+ * The fields of a transducer are preceded by a *kVoodooI2CHIDTransducerFieldBegin* record.
+ */
+
+typedef struct {
+    IOHIDElement*                       element;
+    VoodooI2CDigitiserTransducer*       transducer;
+    UInt32                              report_id;
+    VoodooI2CHIDTransducerFieldTarget   target;
+    UInt32                              bit;
+} VoodooI2CHIDTransducerField;
 
 class VoodooI2CHIDTransducerWrapper : public OSObject {
   OSDeclareDefaultStructors(VoodooI2CHIDTransducerWrapper);
@@ -25,10 +74,28 @@ class VoodooI2CHIDTransducerWrapper : public OSObject {
     
     IOHIDElement* first_identifier;
 
+    VoodooI2CHIDTransducerField* fields;
+    UInt32                       field_count;
+
+    /* Adds a transducer to the wrapper and compiles its elements into <fields>
+     * @transducer The transducer to add
+     *
+     * The logical and physical maxima of the transducer are captured here as they do not change between reports.
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnNoMemory* if the fields could not be allocated
+     */
+
+    IOReturn addTransducer(VoodooI2CDigitiserTransducer* transducer);
+
     bool init() override;
     void free() override;
 
     static VoodooI2CHIDTransducerWrapper* wrapper();
+
+ private:
+    UInt32 field_capacity;
+
+    IOReturn appendField(IOHIDElement* element, VoodooI2CDigitiserTransducer* transducer, VoodooI2CHIDTransducerFieldTarget target, UInt32 bit);
 };
 
 
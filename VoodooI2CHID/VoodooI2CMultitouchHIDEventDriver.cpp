@@ -91,53 +91,317 @@ void VoodooI2CMultitouchHIDEventDriver::handleInterruptReport(AbsoluteTime times
     if (ignore_all)
         return;
     
-    uint64_t now_abs;
-    clock_get_uptime(&now_abs);
-    uint64_t now_ns;
-    absolutetime_to_nanoseconds(now_abs, &now_ns);
-    
-    // Ignore touchpad interaction(s) shortly after typing
-    if (now_ns - key_time < max_after_typing)
-        return;
-    
     if (!readyForReports() || report_type != kIOHIDReportTypeInput)
         return;
 
-    if (digitiser.contact_count && digitiser.contact_count->getValue()) {
-        digitiser.current_contact_count = digitiser.contact_count->getValue();
-        
-        UInt8 finger_count = digitiser.fingers->getCount();
-        
-        digitiser.report_count = static_cast<int>(roundUp(digitiser.current_contact_count, finger_count)/finger_count);
-        digitiser.current_report = 1;
+    // Only finger reports can be split over several reports, everything else is a frame of its own
+
+    if (digitiser.contact_count && digitiser.fingers->getCount() && report_id < DIGITISER_REPORT_ID_COUNT && (digitiser.report_routes[report_id] & kDigitiserReportRouteFingers)) {
+        assembleFrame(timestamp, report_id);
+        return;
+    }
+
+    digitiser.current_report = 1;
+    handleDigitizerReport(timestamp, report_id);
+    forwardFrame(timestamp, report_id);
+}
+
+void VoodooI2CMultitouchHIDEventDriver::assembleFrame(AbsoluteTime timestamp, UInt32 report_id) {
+    UInt8 finger_count = digitiser.fingers->getCount();
+    UInt8 contact_count = digitiser.contact_count->getValue();
+    IOHIDElement* scan_time_element = digitiser.scan_times[report_id];
+    UInt32 scan_time = scan_time_element ? scan_time_element->getValue() : 0;
+
+    if (frame.expected && timestamp - frame.start > frame_timeout) {
+        frames_incomplete++;
+        frame.expected = 0;
     }
 
+    if (contact_count) {
+        // The first report of a frame carries the contact count
+
+        if (frame.expected)
+            frames_incomplete++;
+
+        frame.expected = static_cast<int>(roundUp(contact_count, finger_count)/finger_count);
+        frame.contact_count = contact_count;
+        frame.scan_time = scan_time;
+        frame.received = 0;
+        frame.start = timestamp;
+
+        if (frame.expected > 1)
+            frame_timer->setTimeoutMS(DIGITISER_FRAME_TIMEOUT);
+    } else if (!frame.expected) {
+        // A report without a contact count is only a frame of its own if the whole frame fits in one report or if
+        // it is the report sent once every finger has lifted, otherwise it continues a frame whose first report
+        // was lost or timed out
+
+        if (digitiser.current_contact_count > finger_count && reportHasTouch()) {
+            reports_stale++;
+            return;
+        }
+
+        frame.expected = 1;
+        frame.contact_count = digitiser.current_contact_count;
+        frame.scan_time = scan_time;
+        frame.received = 0;
+        frame.start = timestamp;
+    } else if (scan_time_element && scan_time != frame.scan_time) {
+        reports_stale++;
+        return;
+    }
+
+    if (frame.expected > 64)
+        frame.expected = 64;
+
+    // Work out which part of a hybrid frame this is from the identifier of its first contact,
+    // falling back on arrival order for devices that have no identifiers
+
+    UInt32 slot = __builtin_popcountll(frame.received);
+    IOHIDElement* first_identifier = contacts.wrapper_count ? contacts.wrappers[0]->first_identifier : NULL;
+
+    if (first_identifier && frame.expected > 1)
+        slot = static_cast<int>(roundUp(first_identifier->getValue() + 1, finger_count)/finger_count) - 1;
+
+    if (slot >= frame.expected) {
+        reports_stale++;
+        return;
+    }
+
+    if (frame.received & (1ULL << slot)) {
+        reports_duplicate++;
+        return;
+    }
+
+    digitiser.current_contact_count = frame.contact_count;
+    digitiser.report_count = frame.expected;
+    digitiser.current_report = slot + 1;
+
     handleDigitizerReport(timestamp, report_id);
 
-    if (digitiser.current_report == digitiser.report_count) {
-        VoodooI2CMultitouchEvent event;
-        event.contact_count = digitiser.current_contact_count;
-        event.transducers = digitiser.transducers;
+    frame.received |= 1ULL << slot;
 
+    if (frame.received != (frame.expected == 64 ? ~0ULL : (1ULL << frame.expected) - 1))
+        return;
+
+    frames_completed++;
+    frame.expected = 0;
+    frame_timer->cancelTimeout();
+
+    forwardFrame(timestamp, report_id);
+}
+
+void VoodooI2CMultitouchHIDEventDriver::frameTimedOut(OSObject* owner, IOTimerEventSource* timer) {
+    uint64_t now;
+    clock_get_uptime(&now);
+
+    if (!frame.expected || now - frame.start < frame_timeout)
+        return;
+
+    frames_incomplete++;
+    frame.expected = 0;
+}
+
+bool VoodooI2CMultitouchHIDEventDriver::reportHasTouch() {
+    if (!contacts.wrapper_count)
+        return false;
+
+    VoodooI2CHIDTransducerWrapper* wrapper = contacts.wrappers[0];
+
+    for (UInt32 i = 0; i < wrapper->field_count; i++) {
+        if (wrapper->fields[i].target == kVoodooI2CHIDTransducerFieldTipSwitch && wrapper->fields[i].element->getValue())
+            return true;
+    }
+
+    return false;
+}
+
+void VoodooI2CMultitouchHIDEventDriver::forwardFrame(AbsoluteTime timestamp, UInt32 report_id) {
+    VoodooI2CMultitouchEvent event;
+    event.contact_count = digitiser.current_contact_count;
+    event.transducers = digitiser.transducers;
+
+    if (!filterTyping(timestamp, &event))
+        return;
+
+    IOHIDElement* scan_time_element = report_id < DIGITISER_REPORT_ID_COUNT ? digitiser.scan_times[report_id] : NULL;
+
+    if (!scan_time_element) {
         forwardReport(event, timestamp);
-        
-        digitiser.report_count = 1;
-        digitiser.current_report = 1;
+        return;
+    }
+
+    // VoodooI2CMultitouchEvent has no room for a timestamp of its own so the sample
+    // time is passed down in place of the delivery time
+
+    AbsoluteTime sample_time = mapScanTime(scan_time_element, timestamp);
+
+    forwardReport(event, sample_time);
+
+    uint64_t now;
+    clock_get_uptime(&now);
+    recordLatency(&sample_to_dispatch_latency, sample_time, now);
+}
+
+AbsoluteTime VoodooI2CMultitouchHIDEventDriver::mapScanTime(IOHIDElement* scan_time_element, AbsoluteTime timestamp) {
+    UInt32 scan_time = scan_time_element->getValue();
+    uint64_t host_ns;
+    absolutetime_to_nanoseconds(timestamp, &host_ns);
+
+    uint64_t modulus = static_cast<uint64_t>(scan_time_element->getLogicalMax()) + 1;
+    if (modulus <= 1)
+        modulus = 0x10000;
+
+    if (!scan_clock.valid || host_ns - scan_clock.last_host_ns > (modulus * SCAN_TIME_UNIT_NS) / 2) {
+        scan_clock.valid = true;
+        scan_clock.device_ns = 0;
+        scan_clock.offset_ns = host_ns;
     } else {
-        digitiser.current_report++;
+        uint64_t delta = (scan_time + modulus - scan_clock.last_scan_time) % modulus;
+        scan_clock.device_ns += delta * SCAN_TIME_UNIT_NS;
+
+        SInt64 offset_ns = static_cast<SInt64>(host_ns - scan_clock.device_ns);
+
+        if (offset_ns < scan_clock.offset_ns)
+            scan_clock.offset_ns = offset_ns;
+        else
+            scan_clock.offset_ns += (offset_ns - scan_clock.offset_ns) >> SCAN_TIME_DRIFT_SHIFT;
+    }
+
+    scan_clock.last_scan_time = scan_time;
+    scan_clock.last_host_ns = host_ns;
+
+    // The panel cannot have sampled the report after it was delivered
+
+    uint64_t sample_ns = scan_clock.device_ns + scan_clock.offset_ns;
+    if (sample_ns > host_ns)
+        sample_ns = host_ns;
+
+    AbsoluteTime sample_time;
+    nanoseconds_to_absolutetime(sample_ns, &sample_time);
+
+    return sample_time;
+}
+
+bool VoodooI2CMultitouchHIDEventDriver::filterTyping(AbsoluteTime timestamp, VoodooI2CMultitouchEvent* event) {
+    bool quiet = timestamp < typing.quiet_until;
+    UInt32 end = contacts.stylus_count + event->contact_count;
+
+    if (end > contacts.count)
+        end = contacts.count;
+
+    // Work out which contacts are touching, and which of them have just landed
+
+    UInt64 touching = 0;
+    UInt32 touching_count = 0;
+
+    for (UInt32 index = contacts.stylus_count; index < end; index++) {
+        VoodooI2CDigitiserTransducer* transducer = contacts.transducers[index];
+
+        if (transducer->type != kDigitiserTransducerFinger || !transducer->tip_switch.value())
+            continue;
+
+        touching |= 1ULL << (transducer->secondary_id & 63);
+        touching_count++;
     }
+
+    UInt64 landed = touching & ~typing.active;
+    bool gesture = (touching & typing.active & ~typing.suppressed) || __builtin_popcountll(landed) >= 2;
+    UInt32 suppressed_count = 0;
+
+    for (UInt32 index = contacts.stylus_count; index < end; index++) {
+        VoodooI2CDigitiserTransducer* transducer = contacts.transducers[index];
+        UInt64 contact = 1ULL << (transducer->secondary_id & 63);
+
+        if (!(touching & contact))
+            continue;
+
+        if (!(typing.suppressed & contact)) {
+            if (!quiet || gesture || !(landed & contact))
+                continue;
+
+            UInt64 x = transducer->coordinates.x.value() * 100ULL;
+            UInt64 y = transducer->coordinates.y.value() * 100ULL;
+            UInt64 max_x = transducer->logical_max_x;
+            UInt64 max_y = transducer->logical_max_y;
+
+            bool edge = x < max_x * typing.edge_left || x > max_x * (100 - typing.edge_right)
+                     || y < max_y * typing.edge_top || y > max_y * (100 - typing.edge_bottom);
+
+            if (!edge)
+                continue;
+
+            typing.suppressed |= contact;
+        }
+
+        transducer->is_valid = false;
+        suppressed_count++;
+    }
+
+    // Suppressed contacts keep their slots and are only marked invalid, a report is dropped only when
+    // every touching contact is suppressed and no contact the engines have seen is lifting
+
+    UInt64 lifted = typing.active & ~typing.suppressed & ~touching;
+
+    typing.active = touching;
+    typing.suppressed &= touching;
+
+    if (suppressed_count && suppressed_count == touching_count && !lifted)
+        return false;
+
+    return true;
+}
+
+static inline UInt32 percentage(OSNumber* number) {
+    UInt32 value = number->unsigned32BitValue();
+
+    return value > 100 ? 100 : value;
+}
+
+void VoodooI2CMultitouchHIDEventDriver::configureTyping(OSDictionary* properties) {
+    OSNumber* number = OSDynamicCast(OSNumber, properties->getObject("QuietTimeAfterTyping"));
+    if (number)
+        nanoseconds_to_absolutetime(number->unsigned64BitValue() * 1000000, &typing.quiet_time);
+
+    number = OSDynamicCast(OSNumber, properties->getObject("TypingEdgeLeft"));
+    if (number)
+        typing.edge_left = percentage(number);
+
+    number = OSDynamicCast(OSNumber, properties->getObject("TypingEdgeRight"));
+    if (number)
+        typing.edge_right = percentage(number);
+
+    number = OSDynamicCast(OSNumber, properties->getObject("TypingEdgeTop"));
+    if (number)
+        typing.edge_top = percentage(number);
+
+    number = OSDynamicCast(OSNumber, properties->getObject("TypingEdgeBottom"));
+    if (number)
+        typing.edge_bottom = percentage(number);
 }
 
 void VoodooI2CMultitouchHIDEventDriver::handleDigitizerReport(AbsoluteTime timestamp, UInt32 report_id) {
-    if (!digitiser.transducers)
-        return;
-    
+    uint64_t start, end;
+
+    clock_get_uptime(&start);
+
+    routeDigitizerReport(timestamp, report_id);
+
+    clock_get_uptime(&end);
+
+    if (report_id < DIGITISER_REPORT_ID_COUNT) {
+        report_statistics.count[report_id]++;
+        report_statistics.ticks[report_id] += end - start;
+    }
+}
+
+VoodooI2CHIDTransducerWrapper* VoodooI2CMultitouchHIDEventDriver::findFingerWrapper() {
     VoodooI2CHIDTransducerWrapper* wrapper;
 
-    wrapper = OSDynamicCast(VoodooI2CHIDTransducerWrapper, digitiser.wrappers->getObject(digitiser.current_report - 1));
-    
-    if (!wrapper)
-        return;
+    if (digitiser.current_report - 1 >= contacts.wrapper_count)
+        return NULL;
+
+    wrapper = contacts.wrappers[digitiser.current_report - 1];
 
     UInt8 finger_count = digitiser.fingers->getCount();
     
@@ -146,217 +410,245 @@ void VoodooI2CMultitouchHIDEventDriver::handleDigitizerReport(AbsoluteTime times
         // be the correct index but in rare circumstances, it won't be so we should ensure we have the right index
     
         if (!wrapper->first_identifier)
-            return;
+            return NULL;
     
         UInt8 first_identifier = wrapper->first_identifier->getValue() ? wrapper->first_identifier->getValue() : 0;
     
         UInt8 actual_index = static_cast<int>(roundUp(first_identifier + 1, finger_count)/finger_count) - 1;
     
-        if (actual_index != digitiser.current_report - 1) {
-            wrapper = OSDynamicCast(VoodooI2CHIDTransducerWrapper, digitiser.wrappers->getObject(actual_index));
-            if (!wrapper)
-                return;
-        }
+        if (actual_index != digitiser.current_report - 1)
+            wrapper = actual_index < contacts.wrapper_count ? contacts.wrappers[actual_index] : NULL;
     }
 
-    for (int i = 0; i < wrapper->transducers->getCount(); i++) {
-        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, wrapper->transducers->getObject(i));
-        handleDigitizerTransducerReport(transducer, timestamp, report_id);
+    return wrapper;
+}
+
+void VoodooI2CMultitouchHIDEventDriver::routeDigitizerReport(AbsoluteTime timestamp, UInt32 report_id) {
+    if (!digitiser.transducers || report_id >= DIGITISER_REPORT_ID_COUNT)
+        return;
+    
+    VoodooI2CHIDTransducerWrapper* wrapper;
+    UInt8 route = digitiser.report_routes[report_id];
+
+    if (route & kDigitiserReportRouteFingers) {
+        wrapper = findFingerWrapper();
+
+        if (wrapper)
+            handleDigitizerWrapperReport(wrapper, timestamp, report_id);
     }
     
     // Now handle button report
-    if (digitiser.button) {
-        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, digitiser.transducers->getObject(0));
+    if ((route & kDigitiserReportRouteButton) && contacts.count) {
+        VoodooI2CDigitiserTransducer* transducer = contacts.transducers[0];
         setButtonState(&transducer->physical_button, 0, digitiser.button->getValue(), timestamp);
     }
 
-    if (digitiser.styluses->getCount() > 0) {
-        // The stylus wrapper is the last one
-        wrapper = OSDynamicCast(VoodooI2CHIDTransducerWrapper, digitiser.wrappers->getLastObject());
-        
-        VoodooI2CDigitiserStylus* stylus = OSDynamicCast(VoodooI2CDigitiserStylus, wrapper->transducers->getObject(0));
-        
-        IOHIDElement* element = OSDynamicCast(IOHIDElement, stylus->collection->getChildElements()->getObject(0));
-        
-        if (element && report_id == element->getReportID()) {
-            handleDigitizerTransducerReport(stylus, timestamp, report_id);
+    if (route & kDigitiserReportRouteStylus) {
+        UInt8 stylus = digitiser.stylus_routes[report_id];
+
+        if (stylus != DIGITISER_STYLUS_ROUTE_SHARED) {
+            handleDigitizerWrapperReport(contacts.stylus_wrappers[stylus], timestamp, report_id);
+        } else {
+            for (UInt32 i = 0; i < contacts.stylus_count; i++)
+                handleDigitizerWrapperReport(contacts.stylus_wrappers[i], timestamp, report_id);
         }
     }
 }
 
-void VoodooI2CMultitouchHIDEventDriver::handleDigitizerTransducerReport(VoodooI2CDigitiserTransducer* transducer, AbsoluteTime timestamp, UInt32 report_id) {
-    bool handled = false;
-    bool has_confidence = false;
-    UInt32 element_index = 0;
-    UInt32 element_count = 0;
-    
-    if (!transducer->collection)
-        return;
-    
-    OSArray* child_elements = transducer->collection->getChildElements();
-    
-    if (!child_elements)
-        return;
-    
-    for (element_index=0, element_count=child_elements->getCount(); element_index < element_count; element_index++) {
-        IOHIDElement* element;
-        AbsoluteTime element_timestamp;
-        bool element_is_current;
-        UInt32 usage_page;
-        UInt32 usage;
-        UInt32 value;
-        
-        VoodooI2CDigitiserStylus* stylus = (VoodooI2CDigitiserStylus*)transducer;
-        
-        element = OSDynamicCast(IOHIDElement, child_elements->getObject(element_index));
-        if (!element)
+IOReturn VoodooI2CMultitouchHIDEventDriver::buildContactStore() {
+    releaseContactStore();
+
+    UInt32 count = digitiser.transducers->getCount();
+    UInt32 wrapper_count = digitiser.wrappers->getCount();
+
+    if (count) {
+        contacts.transducers = reinterpret_cast<VoodooI2CDigitiserTransducer**>(IOMalloc(count * sizeof(VoodooI2CDigitiserTransducer*)));
+        contacts.types = reinterpret_cast<UInt8*>(IOMalloc(count * sizeof(UInt8)));
+
+        if (!contacts.transducers || !contacts.types)
+            goto exit;
+    }
+
+    if (wrapper_count) {
+        contacts.wrappers = reinterpret_cast<VoodooI2CHIDTransducerWrapper**>(IOMalloc(wrapper_count * sizeof(VoodooI2CHIDTransducerWrapper*)));
+
+        if (!contacts.wrappers)
+            goto exit;
+    }
+
+    contacts.count = count;
+    contacts.wrapper_count = wrapper_count;
+
+    for (UInt32 i = 0; i < count; i++) {
+        contacts.transducers[i] = OSDynamicCast(VoodooI2CDigitiserTransducer, digitiser.transducers->getObject(i));
+        contacts.types[i] = contacts.transducers[i]->type;
+    }
+
+    for (UInt32 i = 0; i < wrapper_count; i++)
+        contacts.wrappers[i] = OSDynamicCast(VoodooI2CHIDTransducerWrapper, digitiser.wrappers->getObject(i));
+
+    // The stylus wrappers are the last ones
+
+    contacts.stylus_count = digitiser.styluses->getCount() < wrapper_count ? digitiser.styluses->getCount() : wrapper_count;
+    contacts.stylus_wrappers = contacts.stylus_count ? contacts.wrappers + (wrapper_count - contacts.stylus_count) : NULL;
+
+    return kIOReturnSuccess;
+
+exit:
+    contacts.count = count;
+    contacts.wrapper_count = wrapper_count;
+    releaseContactStore();
+    return kIOReturnNoMemory;
+}
+
+void VoodooI2CMultitouchHIDEventDriver::releaseContactStore() {
+    if (contacts.transducers)
+        IOFree(contacts.transducers, contacts.count * sizeof(VoodooI2CDigitiserTransducer*));
+
+    if (contacts.types)
+        IOFree(contacts.types, contacts.count * sizeof(UInt8));
+
+    if (contacts.wrappers)
+        IOFree(contacts.wrappers, contacts.wrapper_count * sizeof(VoodooI2CHIDTransducerWrapper*));
+
+    memset(&contacts, 0, sizeof(contacts));
+}
+
+void VoodooI2CMultitouchHIDEventDriver::buildReportRoutes() {
+    memset(digitiser.report_routes, 0, sizeof(digitiser.report_routes));
+    memset(digitiser.stylus_routes, 0, sizeof(digitiser.stylus_routes));
+
+    UInt32 finger_wrapper_count = contacts.wrapper_count - contacts.stylus_count;
+
+    for (UInt32 i = 0; i < contacts.wrapper_count; i++) {
+        VoodooI2CHIDTransducerWrapper* wrapper = contacts.wrappers[i];
+
+        if (!wrapper)
             continue;
-        
-        element_timestamp = element->getTimeStamp();
-        element_is_current = (element->getReportID() == report_id) && (CMP_ABSOLUTETIME(&timestamp, &element_timestamp) == 0);
-        
-        transducer->id = report_id;
-        transducer->timestamp = element_timestamp;
-        
-        usage_page = element->getUsagePage();
-        usage = element->getUsage();
-        value = element->getValue();
-        
-        switch (usage_page) {
-            case kHIDPage_GenericDesktop:
-                switch (usage) {
-                    case kHIDUsage_GD_X:
-                    {
-                        transducer->coordinates.x.update(element->getValue(), timestamp);
-                        transducer->logical_max_x = element->getLogicalMax();
-                        handled    |= element_is_current;
-                        break;
-                    }
-                    case kHIDUsage_GD_Y:
-                    {
-                        transducer->coordinates.y.update(element->getValue(), timestamp);
-                        transducer->logical_max_y = element->getLogicalMax();
-                        handled    |= element_is_current;
-                        break;
-                    }
-                    case kHIDUsage_GD_Z:
-                    {
-                        transducer->coordinates.z.update(element->getValue(), timestamp);
-                        transducer->logical_max_z = element->getLogicalMax();
-                        handled    |= element_is_current;
-                        break;
-                    }
-                }
+
+        for (UInt32 j = 0; j < wrapper->field_count; j++) {
+            UInt32 report_id = wrapper->fields[j].report_id;
+
+            if (report_id >= DIGITISER_REPORT_ID_COUNT)
+                continue;
+
+            if (i < finger_wrapper_count) {
+                digitiser.report_routes[report_id] |= kDigitiserReportRouteFingers;
+                continue;
+            }
+
+            // A report normally belongs to a single stylus collection, if it does not it is handed to all of them
+
+            UInt8 stylus = i - finger_wrapper_count;
+
+            if ((digitiser.report_routes[report_id] & kDigitiserReportRouteStylus) && digitiser.stylus_routes[report_id] != stylus)
+                stylus = DIGITISER_STYLUS_ROUTE_SHARED;
+
+            digitiser.report_routes[report_id] |= kDigitiserReportRouteStylus;
+            digitiser.stylus_routes[report_id] = stylus;
+        }
+    }
+
+    if (digitiser.button && digitiser.button->getReportID() < DIGITISER_REPORT_ID_COUNT)
+        digitiser.report_routes[digitiser.button->getReportID()] |= kDigitiserReportRouteButton;
+}
+
+void VoodooI2CMultitouchHIDEventDriver::handleDigitizerWrapperReport(VoodooI2CHIDTransducerWrapper* wrapper, AbsoluteTime timestamp, UInt32 report_id) {
+    VoodooI2CHIDTransducerField* field = wrapper->fields;
+    VoodooI2CHIDTransducerField* end = wrapper->fields + wrapper->field_count;
+
+    for (; field < end; field++) {
+        // Collections that live in other reports are left untouched
+
+        if (field->report_id != report_id)
+            continue;
+
+        VoodooI2CDigitiserTransducer* transducer = field->transducer;
+        VoodooI2CDigitiserStylus* stylus = static_cast<VoodooI2CDigitiserStylus*>(transducer);
+
+        if (field->target == kVoodooI2CHIDTransducerFieldBegin) {
+            transducer->id = report_id;
+
+            if (!field->bit)
+                transducer->is_valid = true;
+
+            continue;
+        }
+
+        IOHIDElement* element = field->element;
+        UInt32 value = element->getValue();
+
+        transducer->timestamp = element->getTimeStamp();
+
+        switch (field->target) {
+            case kVoodooI2CHIDTransducerFieldX:
+                transducer->coordinates.x.update(value, timestamp);
                 break;
-            case kHIDPage_Button:
-                setButtonState(&transducer->physical_button, (usage - 1), value, timestamp);
-                handled    |= element_is_current;
+            case kVoodooI2CHIDTransducerFieldY:
+                transducer->coordinates.y.update(value, timestamp);
                 break;
-            case kHIDPage_Digitizer:
-                switch (usage) {
-                    case kHIDUsage_Dig_TransducerIndex:
-                    case kHIDUsage_Dig_ContactIdentifier:
-                        transducer->secondary_id = value;
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Touch:
-                    case kHIDUsage_Dig_TipSwitch:
-                        setButtonState(&transducer->tip_switch, 0, value, timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_InRange:
-                        transducer->in_range = value != 0;
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_TipPressure:
-                    case kHIDUsage_Dig_SecondaryTipSwitch:
-                    {
-                        transducer->tip_pressure.update(element->getValue(), timestamp);
-                        transducer->pressure_physical_max = element->getPhysicalMax();
-                        handled    |= element_is_current;
-                        break;
-                    }
-                    case kHIDUsage_Dig_XTilt:
-                        transducer->tilt_orientation.x_tilt.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_YTilt:
-                        transducer->tilt_orientation.y_tilt.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Azimuth:
-                        transducer->azi_alti_orientation.azimuth.update(element->getValue(), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Altitude:
-                        transducer->azi_alti_orientation.altitude.update(element->getValue(), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Twist:
-                        transducer->azi_alti_orientation.twist.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Width:
-                        transducer->dimensions.width.update(element->getValue(), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_Height:
-                        transducer->dimensions.height.update(element->getValue(), timestamp);
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_DataValid:
-                    case kHIDUsage_Dig_TouchValid:
-                    case kHIDUsage_Dig_Quality:
-                        if (value)
-                            transducer->is_valid = true;
-                        else
-                            transducer->is_valid = false;
-                        has_confidence = true;
-                        handled    |= element_is_current;
-                        break;
-                    case kHIDUsage_Dig_BarrelPressure:
-                        if (stylus) {
-                            stylus->barrel_pressure.update(element->getScaledFixedValue(kIOHIDValueScaleTypeCalibrated), timestamp);
-                            handled    |= element_is_current;
-                        }
-                        break;
-                    case kHIDUsage_Dig_BarrelSwitch:
-                        if (stylus) {
-                            setButtonState(&stylus->barrel_switch, 1, value, timestamp);
-                            handled    |= element_is_current;
-                        }
-                        break;
-                    case kHIDUsage_Dig_BatteryStrength:
-                        if (stylus) {
-                            stylus->battery_strength = element->getValue();
-                            handled |= element_is_current;
-                        }
-                        break;
-                    case kHIDUsage_Dig_Eraser:
-                        if (stylus) {
-                            setButtonState(&stylus->eraser, 2, value, timestamp);
-                            stylus->invert = value != 0;
-                            handled    |= element_is_current;
-                        }
-                        break;
-                    case kHIDUsage_Dig_Invert:
-                        if (stylus) {
-                            stylus->invert = value != 0;
-                            handled    |= element_is_current;
-                        }
-                        break;
-                    default:
-                        break;
-                }
+            case kVoodooI2CHIDTransducerFieldZ:
+                transducer->coordinates.z.update(value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldButton:
+                setButtonState(&transducer->physical_button, field->bit, value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldIdentifier:
+                transducer->secondary_id = value;
+                break;
+            case kVoodooI2CHIDTransducerFieldTipSwitch:
+                setButtonState(&transducer->tip_switch, 0, value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldInRange:
+                transducer->in_range = value != 0;
+                break;
+            case kVoodooI2CHIDTransducerFieldTipPressure:
+                transducer->tip_pressure.update(value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldXTilt:
+                transducer->tilt_orientation.x_tilt.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldYTilt:
+                transducer->tilt_orientation.y_tilt.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldAzimuth:
+                transducer->azi_alti_orientation.azimuth.update(value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldAltitude:
+                transducer->azi_alti_orientation.altitude.update(value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldTwist:
+                transducer->azi_alti_orientation.twist.update(element->getScaledFixedValue(kIOHIDValueScaleTypePhysical), timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldWidth:
+                transducer->dimensions.width.update(value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldHeight:
+                transducer->dimensions.height.update(value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldConfidence:
+                transducer->is_valid = value != 0;
+                break;
+            case kVoodooI2CHIDTransducerFieldBarrelPressure:
+                stylus->barrel_pressure.update(element->getScaledFixedValue(kIOHIDValueScaleTypeCalibrated), timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldBarrelSwitch:
+                setButtonState(&stylus->barrel_switch, 1, value, timestamp);
+                break;
+            case kVoodooI2CHIDTransducerFieldBatteryStrength:
+                stylus->battery_strength = value;
+                break;
+            case kVoodooI2CHIDTransducerFieldEraser:
+                setButtonState(&stylus->eraser, 2, value, timestamp);
+                stylus->invert = value != 0;
+                break;
+            case kVoodooI2CHIDTransducerFieldInvert:
+                stylus->invert = value != 0;
+                break;
+            default:
                 break;
         }
     }
-
-    if (!has_confidence)
-        transducer->is_valid = true;
-    
-    if (!handled)
-        return;
 }
 
 bool VoodooI2CMultitouchHIDEventDriver::handleStart(IOService* provider) {
@@ -382,6 +674,8 @@ bool VoodooI2CMultitouchHIDEventDriver::handleStart(IOService* provider) {
     
     name = getProductName();
 
+    nanoseconds_to_absolutetime(DIGITISER_FRAME_TIMEOUT * 1000000ULL, &frame_timeout);
+
     OSObject* object = copyProperty(kIOHIDAbsoluteAxisBoundsRemovalPercentage, gIOServicePlane);
 
     OSNumber* number = OSDynamicCast(OSNumber, object);
@@ -429,6 +723,8 @@ void VoodooI2CMultitouchHIDEventDriver::handleStop(IOService* provider) {
     //    OSSafeReleaseNULL(digitiser.transducers);
     //}
     
+    releaseContactStore();
+
     if (digitiser.wrappers) {
         OSSafeReleaseNULL(digitiser.wrappers);
     }
@@ -454,6 +750,12 @@ void VoodooI2CMultitouchHIDEventDriver::handleStop(IOService* provider) {
         // multitouch_interface = NULL;
     }
     
+    if (frame_timer) {
+        frame_timer->cancelTimeout();
+        work_loop->removeEventSource(frame_timer);
+        OSSafeReleaseNULL(frame_timer);
+    }
+
     work_loop->removeEventSource(command_gate);
     OSSafeReleaseNULL(command_gate);
 
@@ -562,6 +864,14 @@ IOReturn VoodooI2CMultitouchHIDEventDriver::parseDigitizerElement(IOHIDElement*
             continue;
         }
 
+        if (element->conformsTo(kHIDPage_Digitizer, kHIDUsage_Dig_Scan_Time)) {
+            // The pen and finger collections usually carry a scan time each, in reports of their own
+
+            if (element->getReportID() < DIGITISER_REPORT_ID_COUNT)
+                digitiser.scan_times[element->getReportID()] = element;
+            continue;
+        }
+
         if (element->conformsTo(kHIDPage_Digitizer, kHIDUsage_Dig_DeviceMode)) {
             digitiser.input_mode = element;
             continue;
@@ -640,7 +950,8 @@ IOReturn VoodooI2CMultitouchHIDEventDriver::parseElements() {
             
                 VoodooI2CDigitiserTransducer* transducer = VoodooI2CDigitiserTransducer::transducer(kDigitiserTransducerFinger, finger);
             
-                wrapper->transducers->setObject(transducer);
+                if (wrapper->addTransducer(transducer) != kIOReturnSuccess)
+                    return kIOReturnNoMemory;
                 digitiser.transducers->setObject(transducer);
             }
         
@@ -658,19 +969,26 @@ IOReturn VoodooI2CMultitouchHIDEventDriver::parseElements() {
         }
     }
     
-    // Add stylus as the final wrapper
+    // Add each stylus collection as a wrapper of its own after the finger wrappers, the styluses themselves
+    // go at the front of the transducers
     
-    if (digitiser.styluses->getCount()) {
+    for (int i = 0; i < digitiser.styluses->getCount() && i < DIGITISER_STYLUS_ROUTE_SHARED; i++) {
         VoodooI2CHIDTransducerWrapper* stylus_wrapper = VoodooI2CHIDTransducerWrapper::wrapper();
         digitiser.wrappers->setObject(stylus_wrapper);
         
-        IOHIDElement* stylus = OSDynamicCast(IOHIDElement, digitiser.styluses->getObject(0));
+        IOHIDElement* stylus = OSDynamicCast(IOHIDElement, digitiser.styluses->getObject(i));
         VoodooI2CDigitiserStylus* transducer = VoodooI2CDigitiserStylus::stylus(kDigitiserTransducerStylus, stylus);
         
-        stylus_wrapper->transducers->setObject(transducer);
-        digitiser.transducers->setObject(0, transducer);
+        if (stylus_wrapper->addTransducer(transducer) != kIOReturnSuccess)
+            return kIOReturnNoMemory;
+        digitiser.transducers->setObject(i, transducer);
     }
 
+    if (buildContactStore() != kIOReturnSuccess)
+        return kIOReturnNoMemory;
+
+    buildReportRoutes();
+
     return kIOReturnSuccess;
 }
 
@@ -747,14 +1065,29 @@ bool VoodooI2CMultitouchHIDEventDriver::start(IOService* provider) {
     }
     work_loop->addEventSource(command_gate);
 
+    frame_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CMultitouchHIDEventDriver::frameTimedOut));
+    if (!frame_timer || work_loop->addEventSource(frame_timer) != kIOReturnSuccess) {
+        OSSafeReleaseNULL(frame_timer);
+        return false;
+    }
+
     attached_hid_pointer_devices = OSSet::withCapacity(1);
     registerHIDPointerNotifications();
 
-    // Read QuietTimeAfterTyping configuration value (if available)
-    OSNumber* quietTimeAfterTyping = OSDynamicCast(OSNumber, getProperty("QuietTimeAfterTyping"));
-    
-    if (quietTimeAfterTyping != NULL)
-        max_after_typing = quietTimeAfterTyping->unsigned64BitValue() * 1000000;
+    // Read QuietTimeAfterTyping and the typing edge regions (if available), the defaults cover the edges where palms
+    // rest while typing
+    nanoseconds_to_absolutetime(500 * 1000000ULL, &typing.quiet_time);
+    typing.edge_left = 15;
+    typing.edge_right = 15;
+    typing.edge_top = 0;
+    typing.edge_bottom = 25;
+
+    OSDictionary* configuration = dictionaryWithProperties();
+
+    if (configuration) {
+        configureTyping(configuration);
+        configuration->release();
+    }
 
     setProperty("VoodooI2CServices Supported", OSBoolean::withBoolean(true));
 
@@ -787,8 +1120,13 @@ IOReturn VoodooI2CMultitouchHIDEventDriver::message(UInt32 type, IOService* prov
         }
         case kKeyboardKeyPressTime:
         {
-            //  Remember last time key was pressed
+            //  Remember last time key was pressed, the end of the quiet window is worked out here once
+            //  rather than on every report
             key_time = *((uint64_t*)argument);
+
+            uint64_t key_abs;
+            nanoseconds_to_absolutetime(key_time, &key_abs);
+            typing.quiet_until = key_abs + typing.quiet_time;
 #if DEBUG
             IOLog("%s::keyPressed = %llu\n", getName(), key_time);
 #endif
@@ -804,11 +1142,25 @@ IOReturn VoodooI2CMultitouchHIDEventDriver::setProperties(OSObject * properties)
     OSDictionary* dict = OSDynamicCast(OSDictionary, properties);
     
     if (dict != NULL) {
+        configureTyping(dict);
+
         if (OSCollectionIterator* i = OSCollectionIterator::withCollection(dict)) {
             while (OSSymbol* key = OSDynamicCast(OSSymbol, i->getNextObject())) {
                 // System -> Preferences -> Accessibility -> Mouse & Trackpad -> Ignore built-in trackpad when mouse or wireless trackpad is present
                 // USBMouseStopsTrackpad
-                if (key->isEqualTo("USBMouseStopsTrackpad")) {
+                if (key->isEqualTo("ResetStatistics")) {
+                    OSBoolean* value = OSDynamicCast(OSBoolean, dict->getObject(key));
+
+                    if (!value || !value->isTrue())
+                        continue;
+
+                    memset(&report_statistics, 0, sizeof(report_statistics));
+                    frames_completed = 0;
+                    frames_incomplete = 0;
+                    reports_duplicate = 0;
+                    reports_stale = 0;
+                    memset(&sample_to_dispatch_latency, 0, sizeof(VoodooI2CHIDLatencyHistogram));
+                } else if (key->isEqualTo("USBMouseStopsTrackpad")) {
                     OSNumber* value = OSDynamicCast(OSNumber, dict->getObject(key));
 
                     if (value != NULL) {
@@ -831,6 +1183,69 @@ IOReturn VoodooI2CMultitouchHIDEventDriver::setProperties(OSObject * properties)
     return super::setProperties(properties);
 }
 
+bool VoodooI2CMultitouchHIDEventDriver::serializeProperties(OSSerialize* serializer) const {
+    OSDictionary* statistics = OSDictionary::withCapacity(4);
+
+    if (statistics) {
+        for (int i = 0; i < DIGITISER_REPORT_ID_COUNT; i++) {
+            if (!report_statistics.count[i])
+                continue;
+
+            OSDictionary* report = OSDictionary::withCapacity(2);
+            if (!report)
+                continue;
+
+            uint64_t decode_ns;
+            absolutetime_to_nanoseconds(report_statistics.ticks[i], &decode_ns);
+
+            OSNumber* number = OSNumber::withNumber(report_statistics.count[i], 64);
+            report->setObject("Count", number);
+            OSSafeReleaseNULL(number);
+
+            number = OSNumber::withNumber(decode_ns, 64);
+            report->setObject("DecodeTime", number);
+            OSSafeReleaseNULL(number);
+
+            char key[8];
+            snprintf(key, sizeof(key), "%d", i);
+            statistics->setObject(key, report);
+            report->release();
+        }
+
+        const_cast<VoodooI2CMultitouchHIDEventDriver*>(this)->setProperty("DigitizerReportStatistics", statistics);
+        statistics->release();
+    }
+
+    statistics = OSDictionary::withCapacity(4);
+
+    if (statistics) {
+        OSNumber* number = OSNumber::withNumber(frames_completed, 64);
+        statistics->setObject("FramesCompleted", number);
+        OSSafeReleaseNULL(number);
+
+        number = OSNumber::withNumber(frames_incomplete, 64);
+        statistics->setObject("FramesIncomplete", number);
+        OSSafeReleaseNULL(number);
+
+        number = OSNumber::withNumber(reports_duplicate, 64);
+        statistics->setObject("ReportsDuplicate", number);
+        OSSafeReleaseNULL(number);
+
+        number = OSNumber::withNumber(reports_stale, 64);
+        statistics->setObject("ReportsStale", number);
+        OSSafeReleaseNULL(number);
+
+        OSDictionary* histogram = copyLatencyHistogram(&sample_to_dispatch_latency);
+        statistics->setObject("SampleToDispatchLatency", histogram);
+        OSSafeReleaseNULL(histogram);
+
+        const_cast<VoodooI2CMultitouchHIDEventDriver*>(this)->setProperty("DigitizerFrameStatistics", statistics);
+        statistics->release();
+    }
+
+    return super::serializeProperties(serializer);
+}
+
 void VoodooI2CMultitouchHIDEventDriver::registerHIDPointerNotifications() {
     IOServiceMatchingNotificationHandler notificationHandler = OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &VoodooI2CMultitouchHIDEventDriver::notificationHIDAttachedHandler);
     
@@ -19,6 +19,7 @@
 #include <IOKit/IOLib.h>
 #include <IOKit/IOKitKeys.h>
 #include <IOKit/IOService.h>
+#include <IOKit/IOTimerEventSource.h>
 
 #include <IOKit/hid/IOHIDEvent.h>
 #include <IOKit/hidevent/IOHIDEventService.h>
@@ -39,6 +40,23 @@
 #include "../../../Dependencies/helpers.hpp"
 
 #define kHIDUsage_Dig_Confidence kHIDUsage_Dig_TouchValid
+#define kHIDUsage_Dig_Scan_Time 0x56
+
+#define DIGITISER_FRAME_TIMEOUT 50  // ms, how long a frame waits for its remaining hybrid reports
+
+#define SCAN_TIME_UNIT_NS       100000  // scan time is reported in units of 100us
+#define SCAN_TIME_DRIFT_SHIFT   6       // how slowly the scan time offset follows increases in delivery delay
+
+#define DIGITISER_REPORT_ID_COUNT 256
+
+#define DIGITISER_STYLUS_ROUTE_SHARED 0xFF  // in <digitiser.stylus_routes>, the report is shared by several stylus collections
+
+// What a report carries, indexed by report ID in <digitiser.report_routes>
+enum {
+    kDigitiserReportRouteFingers = 1 << 0,
+    kDigitiserReportRouteStylus  = 1 << 1,
+    kDigitiserReportRouteButton  = 1 << 2
+};
 
 // Message types defined by ApplePS2Keyboard
 enum {
@@ -78,8 +96,42 @@ class VoodooI2CMultitouchHIDEventDriver : public IOHIDEventService {
         UInt8              current_contact_count = 1;
         UInt8              report_count = 1;
         UInt8              current_report = 1;
+
+        UInt8              report_routes[DIGITISER_REPORT_ID_COUNT];
+        UInt8              stylus_routes[DIGITISER_REPORT_ID_COUNT];
+        IOHIDElement*      scan_times[DIGITISER_REPORT_ID_COUNT];
     } digitiser;
 
+    /* Contiguous view of the transducers and wrappers
+     *
+     * The slots mirror <digitiser.transducers> and <digitiser.wrappers>, which are kept for the multitouch interface,
+     * so that the per-report paths need not go through <OSArray::getObject> and <OSDynamicCast>. The store is
+     * sized once the elements have been parsed, from the maximum contact count and the number of styluses.
+     *
+     * Every stylus collection has a transducer and a wrapper of its own. The styluses take the first <stylus_count>
+     * slots of <transducers>, and their wrappers, which <stylus_wrappers> points at, the last <stylus_count> slots of
+     * <wrappers>.
+     */
+
+    struct {
+        UInt32                          count;
+        VoodooI2CDigitiserTransducer**  transducers;
+        UInt8*                          types;
+
+        UInt32                          wrapper_count;
+        VoodooI2CHIDTransducerWrapper** wrappers;
+        UInt32                          stylus_count;
+        VoodooI2CHIDTransducerWrapper** stylus_wrappers;
+    } contacts;
+
+    /* Number of digitiser reports handled and the time spent decoding them, indexed by report ID
+     */
+
+    struct {
+        UInt64             count[DIGITISER_REPORT_ID_COUNT];
+        UInt64             ticks[DIGITISER_REPORT_ID_COUNT];
+    } report_statistics;
+
     /* Calibrates an HID element
      * @element The element to be calibrated
      * @removalPercentage The percentage by which the element is calibrated
@@ -114,13 +166,119 @@ class VoodooI2CMultitouchHIDEventDriver : public IOHIDEventService {
 
     void handleDigitizerReport(AbsoluteTime timestamp, UInt32 report_id);
 
-    /* Called during the interrupt routine to set transducer values
-     * @transducer The transducer to be updated
+    /* Decodes a digitiser report into the transducers that it carries
+     * @timestamp The timestamp of the interrupt report
+     * @report_id The report ID of the interrupt report
+     *
+     * Only the wrappers that <digitiser.report_routes> lists for the report ID are touched.
+     */
+
+    void routeDigitizerReport(AbsoluteTime timestamp, UInt32 report_id);
+
+    /* Finds the wrapper that the current finger report belongs to
+     *
+     * @return The wrapper, or NULL if it could not be determined
+     */
+
+    VoodooI2CHIDTransducerWrapper* findFingerWrapper();
+
+    /* Allocates <contacts> and fills it from <digitiser.transducers> and <digitiser.wrappers>
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnNoMemory* otherwise
+     */
+
+    IOReturn buildContactStore();
+
+    /* Frees the memory allocated by <buildContactStore>
+     */
+
+    void releaseContactStore();
+
+    /* Builds <digitiser.report_routes> and <digitiser.stylus_routes> from the compiled fields of the wrappers
+     */
+
+    void buildReportRoutes();
+
+    /* Called during the interrupt routine to set the values of the transducers in a wrapper
+     * @wrapper The wrapper whose transducers are to be updated
      * @timestamp The timestamp of the interrupt report
      * @report_id The report ID of the interrupt report
+     *
+     * The values are decoded from the fields compiled in <VoodooI2CHIDTransducerWrapper::addTransducer> so that
+     * the child elements of each transducer need not be looked up and classified on every report.
+     */
+
+    void handleDigitizerWrapperReport(VoodooI2CHIDTransducerWrapper* wrapper, AbsoluteTime timestamp, UInt32 report_id);
+
+    /* Adds a finger report to the frame being assembled and forwards the frame once every report has arrived
+     * @timestamp The timestamp of the interrupt report
+     * @report_id The report ID of the interrupt report
+     *
+     * In hybrid mode a frame is split over several reports, the first of which carries the contact count. Reports
+     * that repeat a slot of the frame, or whose scan time does not match it, are dropped, as are reports that continue a
+     * frame whose first report never arrived. A frame that is superseded by a new one or that is not completed within
+     * *DIGITISER_FRAME_TIMEOUT* is discarded without being forwarded.
      */
 
-    void handleDigitizerTransducerReport(VoodooI2CDigitiserTransducer* transducer, AbsoluteTime timestamp, UInt32 report_id);
+    void assembleFrame(AbsoluteTime timestamp, UInt32 report_id);
+
+    /* Discards the frame being assembled once it has waited *DIGITISER_FRAME_TIMEOUT* for its remaining reports
+     * @owner The owner of the timer
+     * @timer The timer that fired
+     */
+
+    void frameTimedOut(OSObject* owner, IOTimerEventSource* timer);
+
+    /* Checks whether any contact of the current finger report is touching
+     *
+     * @return `true` if a tip switch of the report is set, `false` otherwise
+     */
+
+    bool reportHasTouch();
+
+    /* Forwards the current state of the transducers as a multitouch event
+     * @timestamp The timestamp of the last report of the frame
+     * @report_id The report ID of the last report of the frame
+     *
+     * If the report carries a scan time the event is stamped with the time at which the panel sampled it rather
+     * than the time at which the report was delivered.
+     */
+
+    void forwardFrame(AbsoluteTime timestamp, UInt32 report_id);
+
+    /* Maps the scan time of a report to host time
+     * @scan_time_element The scan time element of the report
+     * @timestamp The time at which the report was delivered
+     *
+     * The offset between the two clocks is taken from the report that was delivered the fastest, and is allowed to
+     * creep up slowly so that it follows drift between the two clocks. The mapping starts over whenever the reports
+     * are far enough apart that the scan time could have wrapped around.
+     *
+     * @return The host time at which the panel sampled the report
+     */
+
+    AbsoluteTime mapScanTime(IOHIDElement* scan_time_element, AbsoluteTime timestamp);
+
+    /* Keeps new touches in the edge regions of the digitiser from acting during the quiet window after a key press
+     * @timestamp The timestamp of the last report of the frame
+     * @event The event about to be forwarded
+     *
+     * Only a finger that lands inside one of the edge regions on its own while the window is open is suppressed, it
+     * stays suppressed until it lifts. Contacts that were already down and fingers that land together with another
+     * one, such as at the start of a multi-finger gesture, are let through. Suppressed contacts are only marked invalid,
+     * the event's contact count is left alone.
+     *
+     * @return `false` if every touching contact of the frame is suppressed and no other contact is lifting, so that the
+     * frame should be dropped, `true` otherwise
+     */
+
+    bool filterTyping(AbsoluteTime timestamp, VoodooI2CMultitouchEvent* event);
+
+    /* Reads the typing suppression settings from a dictionary of properties
+     * @properties The dictionary to read from
+     */
+
+    void configureTyping(OSDictionary* properties);
 
     /* Called during the interrupt routine to handle an interrupt report
      * @timestamp The timestamp of the interrupt report
@@ -243,6 +401,14 @@ class VoodooI2CMultitouchHIDEventDriver : public IOHIDEventService {
      */
     virtual IOReturn setProperties(OSObject * properties);
 
+    /* Publishes the per report ID statistics before the properties are serialised
+     * @serializer The serializer
+     *
+     * @return *true* on success, *false* otherwise
+     */
+
+    bool serializeProperties(OSSerialize* serializer) const override;
+
  protected:
     const char* name;
     bool awake = true;
@@ -260,7 +426,64 @@ class VoodooI2CMultitouchHIDEventDriver : public IOHIDEventService {
     bool ignore_all;
     bool ignore_mouse = false;
 
-    uint64_t max_after_typing = 500000000;
+    /* The frame being assembled from hybrid reports
+     *
+     * @expected The number of reports in the frame, 0 if no frame is in progress
+     * @received One bit for every slot of the frame that has been received
+     */
+
+    struct {
+        UInt32             expected;
+        UInt64             received;
+        UInt8              contact_count;
+        UInt32             scan_time;
+        uint64_t           start;
+    } frame;
+
+    uint64_t frame_timeout;
+    IOTimerEventSource* frame_timer = NULL;
+
+    /* State of the mapping between scan time and host time
+     *
+     * @device_ns The scan time unwrapped and converted to nanoseconds
+     * @offset_ns The difference between host time and <device_ns>
+     */
+
+    struct {
+        bool               valid;
+        UInt32             last_scan_time;
+        uint64_t           last_host_ns;
+        uint64_t           device_ns;
+        SInt64             offset_ns;
+    } scan_clock;
+
+    VoodooI2CHIDLatencyHistogram sample_to_dispatch_latency;
+
+    UInt64 frames_completed = 0;
+    UInt64 frames_incomplete = 0;
+    UInt64 reports_duplicate = 0;
+    UInt64 reports_stale = 0;
+
+    /* Typing suppression state
+     *
+     * @quiet_time How long the window after a key press lasts, in absolute time
+     * @quiet_until The end of the current window in absolute time, converted once per key press
+     * @edge_left The width of the left edge region in percent, likewise for the other edges
+     * @active The contact identifiers touching in the previous frame
+     * @suppressed The contact identifiers that are being suppressed until they lift
+     */
+
+    struct {
+        uint64_t           quiet_time;
+        uint64_t           quiet_until;
+        UInt32             edge_left;
+        UInt32             edge_right;
+        UInt32             edge_top;
+        UInt32             edge_bottom;
+        UInt64             active;
+        UInt64             suppressed;
+    } typing;
+
     uint64_t key_time = 0;
     
     IOWorkLoop* work_loop;
@@ -28,6 +28,23 @@ void VoodooI2CPrecisionTouchpadHIDEventDriver::enterPrecisionTouchpadMode() {
     ready = true;
 }
 
+bool VoodooI2CPrecisionTouchpadHIDEventDriver::isInPrecisionTouchpadMode() {
+    // The device answers with the report ID followed by the feature value, the descriptor
+    // also has to account for the two length bytes that are stripped by the transport
+
+    UInt8 buffer[2];
+
+    IOBufferMemoryDescriptor* report = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, 0, sizeof(buffer) + 2);
+    if (!report)
+        return false;
+
+    IOReturn ret = hid_interface->getReport(report, kIOHIDReportTypeFeature, digitiser.input_mode->getReportID());
+    report->readBytes(0, buffer, sizeof(buffer));
+    report->release();
+
+    return ret == kIOReturnSuccess && buffer[0] == digitiser.input_mode->getReportID() && buffer[1] == INPUT_MODE_TOUCHPAD;
+}
+
 void VoodooI2CPrecisionTouchpadHIDEventDriver::handleInterruptReport(AbsoluteTime timestamp, IOMemoryDescriptor *report, IOHIDReportType report_type, UInt32 report_id) {
     if (!ready)
         return;
@@ -57,8 +74,18 @@ IOReturn VoodooI2CPrecisionTouchpadHIDEventDriver::setPowerState(unsigned long w
             awake = false;
     } else {
         if (!awake) {
-            IOSleep(10);
-            enterPrecisionTouchpadMode();
+            VoodooI2CHIDDevice* i2c_hid_device = OSDynamicCast(VoodooI2CHIDDevice, hid_device);
+
+            if (i2c_hid_device && i2c_hid_device->fast_resume) {
+                if (!isInPrecisionTouchpadMode()) {
+                    IOLog("%s::%s Device lost its state during sleep, resetting\n", getName(), name);
+                    i2c_hid_device->resetHIDDevice();
+                    enterPrecisionTouchpadMode();
+                }
+            } else {
+                IOSleep(10);
+                enterPrecisionTouchpadMode();
+            }
 
             awake = true;
         }
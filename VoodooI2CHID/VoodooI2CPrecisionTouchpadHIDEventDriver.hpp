@@ -54,6 +54,13 @@ class VoodooI2CPrecisionTouchpadHIDEventDriver : public VoodooI2CMultitouchHIDEv
 
     /* Sends a report to the device to instruct it to enter Touchpad mode */
     void enterPrecisionTouchpadMode();
+
+    /* Reads back the input mode feature report
+     *
+     * @return *true* if the device is still in Touchpad mode, *false* otherwise
+     */
+
+    bool isInPrecisionTouchpadMode();
 };
 
 
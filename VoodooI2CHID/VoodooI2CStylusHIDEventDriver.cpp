@@ -23,6 +23,26 @@ bool VoodooI2CStylusHIDEventDriver::init(OSDictionary* properties) {
 void VoodooI2CStylusHIDEventDriver::handleInterruptReport(AbsoluteTime timestamp, IOMemoryDescriptor *report, IOHIDReportType report_type, UInt32 report_id) {
     if (!readyForReports() || report_type != kIOHIDReportTypeInput)
         return;
+
+    if (report_id < DIGITISER_REPORT_ID_COUNT && digitiser.report_routes[report_id] == kDigitiserReportRouteStylus) {
+        UInt8 stylus = digitiser.stylus_routes[report_id];
+
+        if (stylus != DIGITISER_STYLUS_ROUTE_SHARED) {
+            uint64_t start, end;
+
+            clock_get_uptime(&start);
+
+            handleDigitizerWrapperReport(contacts.stylus_wrappers[stylus], timestamp, report_id);
+
+            clock_get_uptime(&end);
+
+            report_statistics.count[report_id]++;
+            report_statistics.ticks[report_id] += end - start;
+
+            dispatchStylus(timestamp, stylus);
+            return;
+        }
+    }
     
     digitiser.current_report = 1;
     digitiser.current_contact_count = 1;
@@ -19,6 +19,13 @@ class VoodooI2CStylusHIDEventDriver : public VoodooI2CTouchscreenHIDEventDriver
   OSDeclareDefaultStructors(VoodooI2CStylusHIDEventDriver);
 
  public:
+    /* Pen reports that carry nothing but stylus fields are decoded and dispatched straight from the stylus collection
+     * that <digitiser.stylus_routes> lists for their report ID, leaving the finger wrappers and finger state alone.
+     * Anything else goes through the generic digitiser path.
+     *
+     * @inherit
+     */
+
     void handleInterruptReport(AbsoluteTime timestamp, IOMemoryDescriptor *report, IOHIDReportType report_type, UInt32 report_id) override;
     bool init(OSDictionary* properties);
 };
@@ -12,68 +12,253 @@
 
 OSDefineMetaClassAndStructors(VoodooI2CTouchscreenHIDEventDriver, VoodooI2CMultitouchHIDEventDriver);
 
+#define TILT_MAXIMUM ((89 << 16) - 1)   // tilts are clamped just short of 89 degrees where the tangent is still finite
+
+// tan(n) in 16.16 fixed point for n = 0 to 89 degrees
+
+static const UInt32 tilt_tangents[90] = {
+    0, 1144, 2289, 3435, 4583, 5734, 6888, 8047,
+    9210, 10380, 11556, 12739, 13930, 15130, 16340, 17560,
+    18792, 20036, 21294, 22566, 23853, 25157, 26478, 27818,
+    29179, 30560, 31964, 33392, 34846, 36327, 37837, 39378,
+    40951, 42560, 44205, 45889, 47615, 49385, 51202, 53070,
+    54991, 56970, 59009, 61113, 63287, 65536, 67865, 70279,
+    72785, 75391, 78103, 80930, 83882, 86969, 90203, 93595,
+    97161, 100917, 104880, 109070, 113512, 118230, 123255, 128622,
+    134369, 140542, 147196, 154393, 162207, 170727, 180059, 190330,
+    201699, 214359, 228551, 244584, 262851, 283868, 308323, 337153,
+    371673, 413778, 466313, 533748, 623533, 749080, 937208, 1250501,
+    1876705, 3754555
+};
+
+// atan(n / 256) in degrees in 16.16 fixed point for n = 0 to 256
+
+static const UInt32 tilt_arctangents[257] = {
+    0, 14668, 29335, 44001, 58666, 73329, 87990, 102648,
+    117304, 131955, 146603, 161246, 175884, 190517, 205144, 219765,
+    234379, 248986, 263585, 278177, 292760, 307334, 321899, 336454,
+    350999, 365534, 380058, 394570, 409070, 423558, 438034, 452496,
+    466945, 481380, 495801, 510207, 524598, 538973, 553333, 567676,
+    582003, 596312, 610605, 624879, 639135, 653372, 667591, 681790,
+    695970, 710129, 724268, 738387, 752484, 766560, 780613, 794645,
+    808654, 822641, 836604, 850544, 864460, 878352, 892219, 906062,
+    919879, 933671, 947438, 961178, 974893, 988580, 1002241, 1015875,
+    1029481, 1043060, 1056611, 1070133, 1083627, 1097092, 1110529, 1123936,
+    1137313, 1150661, 1163979, 1177267, 1190524, 1203751, 1216947, 1230111,
+    1243245, 1256347, 1269417, 1282455, 1295461, 1308435, 1321376, 1334285,
+    1347161, 1360004, 1372813, 1385590, 1398332, 1411041, 1423717, 1436358,
+    1448965, 1461538, 1474076, 1486580, 1499049, 1511483, 1523882, 1536246,
+    1548575, 1560868, 1573127, 1585349, 1597536, 1609687, 1621803, 1633882,
+    1645926, 1657933, 1669904, 1681839, 1693738, 1705600, 1717426, 1729215,
+    1740967, 1752683, 1764362, 1776004, 1787610, 1799179, 1810710, 1822205,
+    1833663, 1845084, 1856467, 1867814, 1879123, 1890396, 1901631, 1912829,
+    1923990, 1935113, 1946200, 1957249, 1968261, 1979236, 1990173, 2001074,
+    2011937, 2022763, 2033552, 2044303, 2055018, 2065695, 2076336, 2086939,
+    2097505, 2108034, 2118526, 2128981, 2139399, 2149780, 2160125, 2170432,
+    2180703, 2190937, 2201134, 2211295, 2221419, 2231507, 2241558, 2251572,
+    2261551, 2271492, 2281398, 2291267, 2301101, 2310898, 2320659, 2330384,
+    2340074, 2349727, 2359345, 2368927, 2378474, 2387985, 2397460, 2406901,
+    2416306, 2425675, 2435010, 2444310, 2453574, 2462804, 2471999, 2481159,
+    2490285, 2499376, 2508433, 2517455, 2526443, 2535397, 2544317, 2553203,
+    2562055, 2570873, 2579658, 2588409, 2597126, 2605811, 2614461, 2623079,
+    2631664, 2640215, 2648734, 2657220, 2665673, 2674093, 2682482, 2690837,
+    2699161, 2707452, 2715711, 2723939, 2732134, 2740298, 2748430, 2756531,
+    2764600, 2772638, 2780644, 2788620, 2796564, 2804478, 2812361, 2820213,
+    2828035, 2835826, 2843587, 2851318, 2859019, 2866690, 2874330, 2881941,
+    2889523, 2897075, 2904597, 2912090, 2919554, 2926989, 2934395, 2941772,
+    2949120
+};
+
+// 2^(2^-(n + 1)) in 2.30 fixed point for n = 0 to 15
+
+static const UInt64 exp2_roots[16] = {
+    1518500250, 1276901417, 1170923762, 1121280436,
+    1097253708, 1085434106, 1079572136, 1076653033,
+    1075196443, 1074468888, 1074105294, 1073923544,
+    1073832680, 1073787251, 1073764537, 1073753181
+};
+
+/* Computes log2 of a 16.16 fixed point number in the range (0, 1], the result is in 16.16 fixed point
+ */
+
+static SInt32 fixedLog2(UInt32 value) {
+    SInt32 result = 0;
+    UInt64 z = value;
+
+    while (z < 0x10000) {
+        z <<= 1;
+        result -= 0x10000;
+    }
+
+    for (UInt32 bit = 0x8000; bit; bit >>= 1) {
+        z = (z * z) >> 16;
+
+        if (z >= 0x20000) {
+            z >>= 1;
+            result += bit;
+        }
+    }
+
+    return result;
+}
+
+/* Computes 2 to the power of a non-positive 16.16 fixed point number, the result is in 16.16 fixed point
+ */
+
+static UInt32 fixedExp2(SInt64 exponent) {
+    if (exponent >= 0)
+        return 0x10000;
+
+    SInt64 whole = -((-exponent + 0xFFFF) >> 16);
+    UInt32 fraction = static_cast<UInt32>(exponent - whole * 0x10000);
+    UInt64 result = 1ULL << 30;
+
+    for (int i = 0; i < 16; i++) {
+        if (fraction & (0x8000 >> i))
+            result = (result * exp2_roots[i]) >> 30;
+    }
+
+    SInt64 shift = 14 - whole;
+
+    return shift >= 64 ? 0 : static_cast<UInt32>(result >> shift);
+}
+
+static UInt64 integerSquareRoot(UInt64 value) {
+    UInt64 result = 0;
+    UInt64 bit = 1ULL << 62;
+
+    while (bit > value)
+        bit >>= 2;
+
+    while (bit) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+
+        bit >>= 2;
+    }
+
+    return result;
+}
+
+/* Looks up the tangent of a tilt given in degrees in 16.16 fixed point
+ */
+
+static SInt64 tiltTangent(IOFixed tilt) {
+    UInt32 magnitude = tilt < 0 ? -tilt : tilt;
+
+    if (magnitude > TILT_MAXIMUM)
+        magnitude = TILT_MAXIMUM;
+
+    UInt32 index = magnitude >> 16;
+    UInt32 fraction = magnitude & 0xFFFF;
+
+    SInt64 tangent = tilt_tangents[index] + ((static_cast<UInt64>(tilt_tangents[index + 1] - tilt_tangents[index]) * fraction) >> 16);
+
+    return tilt < 0 ? -tangent : tangent;
+}
+
+/* Looks up the arctangent of numerator / denominator in degrees in 16.16 fixed point, the numerator must not exceed
+ * the denominator
+ */
+
+static IOFixed arctangentRatio(UInt64 numerator, UInt64 denominator) {
+    if (!denominator)
+        return 0;
+
+    UInt32 ratio = static_cast<UInt32>((numerator << 16) / denominator);
+    UInt32 index = ratio >> 8;
+    UInt32 fraction = ratio & 0xFF;
+
+    if (index >= 256)
+        return tilt_arctangents[256];
+
+    return tilt_arctangents[index] + (((tilt_arctangents[index + 1] - tilt_arctangents[index]) * fraction) >> 8);
+}
+
+/* Converts the X and Y tilt of a stylus to the azimuth and altitude expected by polar orientation events, all angles
+ * are in degrees in 16.16 fixed point
+ */
+
+static void convertTilt(IOFixed x_tilt, IOFixed y_tilt, IOFixed* azimuth, IOFixed* altitude) {
+    SInt64 tangent_x = tiltTangent(x_tilt);
+    SInt64 tangent_y = tiltTangent(y_tilt);
+
+    UInt64 magnitude_x = tangent_x < 0 ? -tangent_x : tangent_x;
+    UInt64 magnitude_y = tangent_y < 0 ? -tangent_y : tangent_y;
+
+    *azimuth = 0;
+
+    if (magnitude_x || magnitude_y) {
+        IOFixed angle = magnitude_y <= magnitude_x ? arctangentRatio(magnitude_y, magnitude_x) : (90 << 16) - arctangentRatio(magnitude_x, magnitude_y);
+
+        // The azimuth runs counter clockwise with the Y axis pointing up, a positive Y tilt is towards the user
+
+        if (tangent_x >= 0 && tangent_y <= 0)
+            *azimuth = angle;
+        else if (tangent_x < 0 && tangent_y <= 0)
+            *azimuth = (180 << 16) - angle;
+        else if (tangent_x < 0)
+            *azimuth = (180 << 16) + angle;
+        else
+            *azimuth = (360 << 16) - angle;
+    }
+
+    UInt64 radius = integerSquareRoot(magnitude_x * magnitude_x + magnitude_y * magnitude_y);
+
+    *altitude = radius <= 0x10000 ? (90 << 16) - arctangentRatio(radius, 0x10000) : arctangentRatio(0x10000, radius);
+}
+
 // Override of VoodooI2CMultitouchHIDEventDriver
 
 bool VoodooI2CTouchscreenHIDEventDriver::checkFingerTouch(AbsoluteTime timestamp, VoodooI2CMultitouchEvent event) {
     bool got_transducer = false;
     
-    // If there is a finger touch event, decide if it is single or multitouch.
+    // If there is a finger touch event, decide if it is single or multitouch. The fingers follow the styluses
+    // in the contact store.
     
-    for (int index = 0; index < digitiser.contact_count->getValue() + 1; index++) {
-        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
-        
-        if (!transducer)
+    for (int index = contacts.stylus_count; index < contacts.stylus_count + event.contact_count; index++) {
+        if (index >= contacts.count)
             return false;
+
+        VoodooI2CDigitiserTransducer* transducer = contacts.transducers[index];
+
+        // Palms have been marked invalid by <rejectPalms>
+
+        if (!transducer->is_valid)
+            continue;
         
-        if (transducer->type == kDigitiserTransducerFinger && digitiser.contact_count->getValue() >= 2) {
+        if (transducer->type == kDigitiserTransducerFinger && valid_contact_count >= 2) {
             // Our finger event is multitouch reset clicktick and wait to be dispatched to the multitouch engines.
             
             click_tick = 0;
+            hold.active = false;
         }
         
         if (transducer->type == kDigitiserTransducerFinger && transducer->tip_switch.value()) {
-            if (transducer->logical_max_x == 0 || transducer->logical_max_y == 0) {
-                IOLog("%s:%s: Divided by zero in checkFingerTouch(). value / (%X or %X)\n", getName(), name, transducer->logical_max_x, transducer->logical_max_y);
+            const VoodooI2CTouchscreenTransform* transform = &transforms[index];
+
+            if (!transform->valid)
                 continue;
-            }
             
             got_transducer = true;
             // Convert logical coordinates to IOFixed and Scaled;
             
-            IOFixed x = ((UInt32)transducer->coordinates.x.value() * 0xFFFF) / transducer->logical_max_x;
-            IOFixed y = ((UInt32)transducer->coordinates.y.value() * 0xFFFF) / transducer->logical_max_y;
+            IOFixed x = scaleAxis(&transform->x, (UInt32)transducer->coordinates.x.value());
+            IOFixed y = scaleAxis(&transform->y, (UInt32)transducer->coordinates.y.value());
             
             checkRotation(&x, &y);
             
-            // Track last ID and coordinates so that we can send the finger lift event after our watch dog timeout.
+            // Track last ID and coordinates so that we can send the finger lift event when the finger leaves.
             last_x = x;
             last_y = y;
             last_id = transducer->secondary_id;
             
-            // Begin long press right click routine.  Increasing compare_input_counter check will lengthen the time until execution.
-            
-            UInt16 temp_x = x;
-            UInt16 temp_y = y;
-            
-            if (!right_click && digitiser.contact_count->getValue() == 1 && transducer->type == kDigitiserTransducerFinger && transducer->tip_switch) {
-                if (temp_x == compare_input_x && temp_y == compare_input_y) {
-                    compare_input_counter = compare_input_counter + 1;
-                    compare_input_x = temp_x;
-                    compare_input_y = temp_y;
-                    
-                    if (compare_input_counter >= 120 && !right_click) {
-                        compare_input_x = 0;
-                        compare_input_y = 0;
-                        compare_input_counter = 0;
-                        right_click = true;
-                    }
-                } else {
-                    compare_input_x = temp_x;
-                    compare_input_y = temp_y;
-                    compare_input_counter = 0;
-                }
-            }
-            //  End long press right click routine.
+            if (!right_click && valid_contact_count == 1)
+                checkLongPress(timestamp, x, y);
             
             
             //  We need the first couple of single touch events to be in hover mode.  In modes such as Mission Control, this allows us
@@ -92,28 +277,157 @@ bool VoodooI2CTouchscreenHIDEventDriver::checkFingerTouch(AbsoluteTime timestamp
             
             dispatchDigitizerEventWithTiltOrientation(timestamp, transducer->secondary_id, transducer->type, 0x1, buttons, x, y);
             
-            //  This timer serves to let us know when a finger based event is finished executing as well as let us
-            // know to reset the clicktick counter.
-            
-            
-            timer_source->setTimeoutMS(14);
+            fingerDown();
         }
     }
     return got_transducer;
 }
 
+UInt8 VoodooI2CTouchscreenHIDEventDriver::rejectPalms(UInt8 contact_count) {
+    bool pen_in_range = false;
+    IOFixed pen_x = 0, pen_y = 0;
+
+    for (UInt32 index = 0; index < contacts.stylus_count; index++) {
+        VoodooI2CDigitiserTransducer* stylus = contacts.transducers[index];
+
+        if (stylus->in_range && transforms[index].valid) {
+            pen_in_range = true;
+            pen_x = scaleAxis(&transforms[index].x, (UInt32)stylus->coordinates.x.value());
+            pen_y = scaleAxis(&transforms[index].y, (UInt32)stylus->coordinates.y.value());
+            break;
+        }
+    }
+
+    UInt8 rejected = 0;
+    UInt32 end = contacts.stylus_count + contact_count;
+
+    if (end > contacts.count)
+        end = contacts.count;
+
+    for (UInt32 index = contacts.stylus_count; index < end; index++) {
+        VoodooI2CDigitiserTransducer* transducer = contacts.transducers[index];
+        VoodooI2CTouchscreenTransform* transform = &transforms[index];
+
+        // The rejection follows the slot of the contact, which holds the same contact until it lifts whatever
+        // identifier the device gives it
+
+        if (!transducer->tip_switch.value()) {
+            transform->palm = false;
+            continue;
+        }
+
+        bool palm = !transducer->is_valid || transform->palm;
+
+        if (!palm && transform->palm_width && transducer->dimensions.width.value() >= transform->palm_width)
+            palm = true;
+
+        if (!palm && transform->palm_height && transducer->dimensions.height.value() >= transform->palm_height)
+            palm = true;
+
+        if (!palm && pen_in_range && palm_pen_radius && transform->valid) {
+            SInt64 delta_x = scaleAxis(&transform->x, (UInt32)transducer->coordinates.x.value()) - pen_x;
+            SInt64 delta_y = scaleAxis(&transform->y, (UInt32)transducer->coordinates.y.value()) - pen_y;
+
+            palm = delta_x * delta_x + delta_y * delta_y <= static_cast<SInt64>(palm_pen_radius) * palm_pen_radius;
+        }
+
+        if (!palm)
+            continue;
+
+        transducer->is_valid = false;
+        transform->palm = true;
+        rejected++;
+    }
+
+    return rejected < contact_count ? contact_count - rejected : 0;
+}
+
+void VoodooI2CTouchscreenHIDEventDriver::checkLongPress(AbsoluteTime timestamp, IOFixed x, IOFixed y) {
+    // The hold is anchored where it started rather than where the last report was so that sensor jitter
+    // neither resets it nor lets it drift away
+
+    SInt64 delta_x = x - hold.x;
+    SInt64 delta_y = y - hold.y;
+
+    if (!hold.active || delta_x * delta_x + delta_y * delta_y > static_cast<SInt64>(long_press_radius) * long_press_radius) {
+        hold.active = true;
+        hold.x = x;
+        hold.y = y;
+        hold.start = timestamp;
+        return;
+    }
+
+    if (timestamp - hold.start >= long_press_duration) {
+        hold.active = false;
+        right_click = true;
+    }
+}
+
 void VoodooI2CTouchscreenHIDEventDriver::checkRotation(IOFixed* x, IOFixed* y) {
-    if (active_framebuffer) {
-        if (current_rotation & kIOFBSwapAxes) {
-            IOFixed old_x = *x;
-            *x = *y;
-            *y = old_x;
+    if (orientation.rotation != current_rotation)
+        buildOrientation();
+
+    if (orientation.swap_axes) {
+        IOFixed old_x = *x;
+        *x = *y;
+        *y = old_x;
+    }
+
+    *x = orientation.origin_x + orientation.sign_x * *x;
+    *y = orientation.origin_y + orientation.sign_y * *y;
+}
+
+void VoodooI2CTouchscreenHIDEventDriver::buildOrientation() {
+    UInt8 rotation = current_rotation;
+
+    orientation.swap_axes = rotation & kIOFBSwapAxes;
+
+    orientation.origin_x = (rotation & kIOFBInvertX) ? 65535 : 0;
+    orientation.sign_x = (rotation & kIOFBInvertX) ? -1 : 1;
+    orientation.origin_y = (rotation & kIOFBInvertY) ? 65535 : 0;
+    orientation.sign_y = (rotation & kIOFBInvertY) ? -1 : 1;
+
+    orientation.rotation = rotation;
+}
+
+IOReturn VoodooI2CTouchscreenHIDEventDriver::buildTransforms() {
+    if (!contacts.count)
+        return kIOReturnSuccess;
+
+    transforms = reinterpret_cast<VoodooI2CTouchscreenTransform*>(IOMalloc(contacts.count * sizeof(VoodooI2CTouchscreenTransform)));
+    if (!transforms)
+        return kIOReturnNoMemory;
+
+    memset(transforms, 0, contacts.count * sizeof(VoodooI2CTouchscreenTransform));
+
+    for (int index = 0; index < contacts.count; index++) {
+        VoodooI2CDigitiserTransducer* transducer = contacts.transducers[index];
+        VoodooI2CTouchscreenTransform* transform = &transforms[index];
+
+        setAxisScale(&transform->x, transducer->logical_max_x);
+        setAxisScale(&transform->y, transducer->logical_max_y);
+        transform->valid = transducer->logical_max_x && transducer->logical_max_y;
+
+        // Contact dimensions are reported in the same units as the coordinates
+
+        transform->palm_width = static_cast<UInt32>((static_cast<UInt64>(transducer->logical_max_x) * palm_size) / 100);
+        transform->palm_height = static_cast<UInt32>((static_cast<UInt64>(transducer->logical_max_y) * palm_size) / 100);
+
+        if (contacts.types[index] == kDigitiserTransducerStylus) {
+            VoodooI2CDigitiserStylus* stylus = (VoodooI2CDigitiserStylus*)transducer;
+
+            setAxisScale(&transform->z, stylus->logical_max_z);
+            setAxisScale(&transform->pressure, stylus->pressure_physical_max);
+            transform->valid = transform->valid && stylus->logical_max_z && stylus->pressure_physical_max;
+
+            if (!transform->valid)
+                IOLog("%s::%s Ignoring stylus %d with a zero logical maximum (%X, %X, %X, or %X)\n", getName(), name, index, stylus->logical_max_x, stylus->logical_max_y, stylus->logical_max_z, stylus->pressure_physical_max);
+        } else if (!transform->valid) {
+            IOLog("%s::%s Ignoring transducer %d with a zero logical maximum (%X or %X)\n", getName(), name, index, transducer->logical_max_x, transducer->logical_max_y);
         }
-        if (current_rotation & kIOFBInvertX)
-            *x = 65535 - *x;
-        if (current_rotation & kIOFBInvertY)
-            *y = 65535 - *y;
     }
+
+    return kIOReturnSuccess;
 }
 
 bool VoodooI2CTouchscreenHIDEventDriver::checkStylus(AbsoluteTime timestamp, VoodooI2CMultitouchEvent event) {
@@ -121,131 +435,264 @@ bool VoodooI2CTouchscreenHIDEventDriver::checkStylus(AbsoluteTime timestamp, Voo
     //  At this time, Apple has removed all methods of handling additional information from the event driver.  Only x, y, buttonstate, and
     //  inrange are valid for macOS Sierra +.  10.11 still makes use of extended functions.
     
-    for (int index = 0, count = event.transducers->getCount(); index < count; index++) {
-        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
+    //  Every stylus collection is tracked on its own so that dual pen devices are handled concurrently, the
+    //  styluses sit at the front of the contact store so only those slots are looked at.
 
-        if (transducer && transducer->type == kDigitiserTransducerStylus && transducer->in_range) {
-            VoodooI2CDigitiserStylus* stylus = (VoodooI2CDigitiserStylus*)transducer;
-            
-            if (stylus->logical_max_x == 0 || stylus->logical_max_y == 0 || stylus->logical_max_z == 0 || stylus->pressure_physical_max == 0) {
-                IOLog("%s:%s: Divided by zero in checkStylus(). value / (%X, %X, %X, or %X)\n", getName(), name, stylus->logical_max_x, stylus->logical_max_y, stylus->logical_max_z, stylus->pressure_physical_max);
-                continue;
-            }
-            IOFixed x = ((UInt32)stylus->coordinates.x.value() * 0xFFFF) / stylus->logical_max_x;
-            IOFixed y = ((UInt32)stylus->coordinates.y.value() * 0xFFFF) / stylus->logical_max_y;
-            IOFixed z = ((UInt32)stylus->coordinates.z.value() * 0xFFFF) / stylus->logical_max_z;
-            IOFixed stylus_pressure = ((UInt32)stylus->tip_pressure.value() * 0xFFFF) /stylus->pressure_physical_max;
-            
-            checkRotation(&x, &y);
-            
-            if (stylus->barrel_switch.value() != 0x0 && stylus->barrel_switch.value() !=0x2 && (stylus->barrel_switch.value()-barrel_switch_offset) != 0x2)
-                barrel_switch_offset = stylus->barrel_switch.value();
-            if (stylus->eraser.value() != 0x0 && stylus->eraser.value() !=0x2 && (stylus->eraser.value()-eraser_switch_offset) != 0x4)
-                eraser_switch_offset = stylus->eraser.value();
-            
-            stylus_buttons = stylus->tip_switch.value();
-            
-            if (stylus->barrel_switch.value() == 0x2 || (stylus->barrel_switch.value() - barrel_switch_offset) == 0x2) {
-                stylus_buttons = 0x2;
-            }
-            
-            if (stylus->eraser.value() == 0x4 || (stylus->eraser.value() - eraser_switch_offset) == 0x4) {
-                stylus_buttons = 0x4;
-            }
-            
-            dispatchDigitizerEventWithTiltOrientation(timestamp, stylus->secondary_id, stylus->type, stylus->in_range, stylus_buttons, x, y, z, stylus_pressure, stylus->barrel_pressure.value(), stylus->azi_alti_orientation.twist.value(), stylus->tilt_orientation.x_tilt.value(), stylus->tilt_orientation.y_tilt.value());
-            
-            return true;
-        }
+    bool got_stylus = false;
+
+    for (int index = 0; index < contacts.stylus_count; index++) {
+        if (dispatchStylus(timestamp, index))
+            got_stylus = true;
     }
     
-    return false;
+    return got_stylus;
 }
 
-void VoodooI2CTouchscreenHIDEventDriver::fingerLift() {
-    //  Here we execute a single touch pointer lift event.  Finger based digitizer events have no in_range
-    // component.  Greater accuracy / error rejection is achieved by filtering by tip_switch vs transducer id in the
-    //  checkFingerTouch function, however, this has the side effect of not releasing the pointer.  This watchdog
-    //  timer is needed regardless so the pointer release is best done here.
+bool VoodooI2CTouchscreenHIDEventDriver::dispatchStylus(AbsoluteTime timestamp, UInt32 index) {
+    VoodooI2CDigitiserStylus* stylus = (VoodooI2CDigitiserStylus*)contacts.transducers[index];
+    const VoodooI2CTouchscreenTransform* transform = &transforms[index];
+
+    if (!stylus->in_range || !transform->valid)
+        return false;
+
+    IOFixed x = scaleAxis(&transform->x, (UInt32)stylus->coordinates.x.value());
+    IOFixed y = scaleAxis(&transform->y, (UInt32)stylus->coordinates.y.value());
+    IOFixed z = scaleAxis(&transform->z, (UInt32)stylus->coordinates.z.value());
+    IOFixed stylus_pressure = applyPressureCurve(scaleAxis(&transform->pressure, (UInt32)stylus->tip_pressure.value()));
     
+    checkRotation(&x, &y);
+
+    IOFixed azimuth, altitude;
+    convertTilt(stylus->tilt_orientation.x_tilt.value(), stylus->tilt_orientation.y_tilt.value(), &azimuth, &altitude);
     
-    click_tick = 0;
-    start_scroll = true;
-    uint64_t now_abs;
-    clock_get_uptime(&now_abs);
+    // The barrel switch and eraser are decoded into bits 1 and 2 of their button states
     
-    dispatchDigitizerEventWithTiltOrientation(now_abs, last_id, kDigitiserTransducerFinger, 0x1, 0x0, last_x, last_y);
+    stylus_buttons = stylus->tip_switch.value();
     
+    if (stylus->barrel_switch.value() & 0x2)
+        stylus_buttons = 0x2;
     
-    //  If a right click has been executed, we reset our counter and ensure that pointer is not stuck in right
-    //  click button down situation.
+    if (stylus->eraser.value() & 0x4)
+        stylus_buttons = 0x4;
     
-    if (right_click) {
-        right_click = false;
+    dispatchDigitizerEventWithPolarOrientation(timestamp, stylus->secondary_id, stylus->type, stylus->in_range, stylus_buttons, x, y, z, stylus_pressure, stylus->barrel_pressure.value(), stylus->azi_alti_orientation.twist.value(), altitude, azimuth);
+    
+    return true;
+}
+
+void VoodooI2CTouchscreenHIDEventDriver::buildPressureCurve() {
+    UInt32 gamma = 100;
+    UInt32 minimum = 0;
+    UInt32 maximum = 100;
+
+    OSNumber* number = OSDynamicCast(OSNumber, getProperty("PressureGamma"));
+    if (number && number->unsigned32BitValue())
+        gamma = number->unsigned32BitValue();
+
+    number = OSDynamicCast(OSNumber, getProperty("PressureMinimum"));
+    if (number)
+        minimum = number->unsigned32BitValue();
+
+    number = OSDynamicCast(OSNumber, getProperty("PressureMaximum"));
+    if (number)
+        maximum = number->unsigned32BitValue();
+
+    if (maximum > 100)
+        maximum = 100;
+
+    if (minimum >= maximum) {
+        IOLog("%s::%s Ignoring pressure minimum %d which is not below the maximum %d\n", getName(), name, minimum, maximum);
+        minimum = 0;
+    }
+
+    pressure_curve.linear = gamma == 100 && minimum == 0 && maximum == 100;
+
+    if (pressure_curve.linear)
+        return;
+
+    UInt32 low = (minimum << 16) / 100;
+    UInt32 high = (maximum << 16) / 100;
+    SInt64 exponent = (static_cast<SInt64>(gamma) << 16) / 100;
+
+    for (UInt32 i = 0; i < PRESSURE_CURVE_SIZE; i++) {
+        UInt32 input = i << PRESSURE_CURVE_SHIFT;
+
+        if (input <= low) {
+            pressure_curve.table[i] = 0;
+        } else if (input >= high) {
+            pressure_curve.table[i] = 0xFFFF;
+        } else {
+            UInt32 normalised = static_cast<UInt32>((static_cast<UInt64>(input - low) << 16) / (high - low));
+            UInt32 output = fixedExp2((fixedLog2(normalised) * exponent) >> 16);
+
+            pressure_curve.table[i] = output > 0xFFFF ? 0xFFFF : output;
+        }
     }
 }
 
-IOFramebuffer* VoodooI2CTouchscreenHIDEventDriver::getFramebuffer() {
-    IODisplay* display = NULL;
-    IOFramebuffer* framebuffer = NULL;
+IOFixed VoodooI2CTouchscreenHIDEventDriver::applyPressureCurve(IOFixed pressure) {
+    if (pressure_curve.linear)
+        return pressure;
+
+    UInt32 input = pressure < 0 ? 0 : (pressure > 0xFFFF ? 0xFFFF : pressure);
+    UInt32 index = input >> PRESSURE_CURVE_SHIFT;
+    UInt32 fraction = input & ((1 << PRESSURE_CURVE_SHIFT) - 1);
+
+    return pressure_curve.table[index] + (((pressure_curve.table[index + 1] - pressure_curve.table[index]) * fraction) >> PRESSURE_CURVE_SHIFT);
+}
+
+void VoodooI2CTouchscreenHIDEventDriver::fingerDown() {
+    if (finger_down)
+        return;
+
+    finger_down = true;
+
+    // The timer is armed once per touch rather than once per report, <fingerLift> pushes it back itself
+    // for as long as reports keep arriving
+
+    timer_source->setTimeoutMS(FINGER_LIFT_TIMEOUT);
+}
+
+void VoodooI2CTouchscreenHIDEventDriver::releaseFinger(AbsoluteTime timestamp) {
+    //  Here we execute a single touch pointer lift event.  Finger based digitizer events have no in_range
+    // component so the release is driven by the tip switch dropping or the contact count reaching zero.
+
+    timer_source->cancelTimeout();
+
+    finger_down = false;
+    hold.active = false;
+    click_tick = 0;
+    start_scroll = true;
+    
+    dispatchDigitizerEventWithTiltOrientation(timestamp, last_id, kDigitiserTransducerFinger, 0x1, 0x0, last_x, last_y);
+    
+    //  If a right click has been executed, we ensure that pointer is not stuck in right
+    //  click button down situation.
     
-    OSDictionary *match = serviceMatching("IODisplay");
-    OSIterator *iterator = getMatchingServices(match);
+    right_click = false;
+}
 
-    if (iterator) {
-        display = OSDynamicCast(IODisplay, iterator->getNextObject());
-        
-        if (display) {
-            IOLog("%s::Got active display\n", getName());
-            
-            framebuffer = OSDynamicCast(IOFramebuffer, display->getParentEntry(gIOServicePlane)->getParentEntry(gIOServicePlane));
-            
-            if (framebuffer)
-                IOLog("%s::Got active framebuffer\n", getName());
-        }
-        
-        iterator->release();
+void VoodooI2CTouchscreenHIDEventDriver::fingerLift() {
+    if (!finger_down)
+        return;
+
+    uint64_t now_abs;
+    clock_get_uptime(&now_abs);
+
+    uint64_t timeout;
+    nanoseconds_to_absolutetime(FINGER_LIFT_TIMEOUT * 1000000ULL, &timeout);
+
+    if (now_abs - last_report_time < timeout) {
+        timer_source->wakeAtTime(last_report_time + timeout);
+        return;
     }
 
-    return framebuffer;
+    releaseFinger(now_abs);
+}
+
+bool VoodooI2CTouchscreenHIDEventDriver::displayPublished(void* refCon, IOService* display, IONotifier* notifier) {
+    if (active_framebuffer)
+        return true;
+
+    IORegistryEntry* parent = display->getParentEntry(gIOServicePlane);
+    IOFramebuffer* framebuffer = parent ? OSDynamicCast(IOFramebuffer, parent->getParentEntry(gIOServicePlane)) : NULL;
+
+    if (!framebuffer)
+        return true;
+
+    IOLog("%s::Got active framebuffer\n", getName());
+
+    framebuffer->retain();
+    active_framebuffer = framebuffer;
+
+    framebuffer_notifier = IOFramebuffer::addFramebufferNotification(active_framebuffer, &VoodooI2CTouchscreenHIDEventDriver::framebufferNotification, this);
+
+    updateRotation(true);
+
+    return true;
+}
+
+IOReturn VoodooI2CTouchscreenHIDEventDriver::framebufferNotification(OSObject* self, void* ref, IOFramebuffer* framebuffer, IOIndex event, void* info) {
+    VoodooI2CTouchscreenHIDEventDriver* driver = OSDynamicCast(VoodooI2CTouchscreenHIDEventDriver, self);
+
+    if (driver && (event == kIOFBNotifyDisplayModeDidChange || event == kIOFBNotifyDidWake))
+        driver->updateRotation(false);
+
+    return kIOReturnSuccess;
+}
+
+void VoodooI2CTouchscreenHIDEventDriver::updateRotation(bool force) {
+    if (!active_framebuffer || !multitouch_interface)
+        return;
+
+    OSNumber* transform = OSDynamicCast(OSNumber, active_framebuffer->getProperty(kIOFBTransformKey));
+    if (!transform)
+        return;
+
+    UInt8 rotation = transform->unsigned8BitValue() / 0x10;
+
+    if (!force && rotation == current_rotation)
+        return;
+
+    current_rotation = rotation;
+
+    OSNumber* number = OSNumber::withNumber(rotation, 8);
+    multitouch_interface->setProperty(kIOFBTransformKey, number);
+    OSSafeReleaseNULL(number);
 }
 
 void VoodooI2CTouchscreenHIDEventDriver::forwardReport(VoodooI2CMultitouchEvent event, AbsoluteTime timestamp) {
-    if (!active_framebuffer)
-        active_framebuffer = getFramebuffer();
+    last_report_time = timestamp;
 
-    if (active_framebuffer) {
-        OSNumber* number = OSDynamicCast(OSNumber, active_framebuffer->getProperty(kIOFBTransformKey));
-        current_rotation = number->unsigned8BitValue() / 0x10;
-        multitouch_interface->setProperty(kIOFBTransformKey, OSNumber::withNumber(current_rotation, 8));
+    // The contact count field only holds the count in the first report of a hybrid frame, the
+    // event carries the count that the frame was assembled with
+
+    event.transducers = digitiser.transducers;
+
+    // Send multitouch information to the multitouch interface
+
+    if (!event.contact_count) {
+        if (finger_down)
+            releaseFinger(timestamp);
+        return;
     }
-    
-    if (event.contact_count) {
-        event.contact_count = digitiser.contact_count->getValue();
-        event.transducers = digitiser.transducers;
 
-        // Send multitouch information to the multitouch interface
-    
-        if (!event.contact_count)
-            return;
-    
-        if (event.contact_count > 5) {
-            return;
-        }
+    if (event.contact_count > 5) {
+        return;
+    }
 
-        if (event.contact_count >= 2) {
-            if (event.contact_count == 2 && start_scroll) {
-                scrollPosition(timestamp, event);
-            } else if (event.contact_count == 2 && !start_scroll) {
-                timer_source->setTimeoutMS(14);
-            }
+    // Palms keep their slots in the event and are only marked invalid so that the contacts after them
+    // are not dropped, the choice between single touch and multitouch is made on the contacts that are left
 
-            multitouch_interface->handleInterruptReport(event, timestamp);
-        } else {
-            // Process single touch data
-            if (!checkStylus(timestamp, event)) {
-                if (!checkFingerTouch(timestamp, event))
-                    multitouch_interface->handleInterruptReport(event, timestamp);
+    valid_contact_count = rejectPalms(event.contact_count);
+
+    if (!valid_contact_count) {
+        if (finger_down)
+            releaseFinger(timestamp);
+
+        // Every finger was a palm, the pen may still need to be dispatched and the multitouch
+        // engines still need to see any contact lifting in this report
+
+        checkStylus(timestamp, event);
+        multitouch_interface->handleInterruptReport(event, timestamp);
+        return;
+    }
+
+    if (valid_contact_count >= 2) {
+        if (valid_contact_count == 2 && start_scroll)
+            scrollPosition(timestamp, event);
+
+        multitouch_interface->handleInterruptReport(event, timestamp);
+    } else {
+        // Process single touch data
+        if (!checkStylus(timestamp, event)) {
+            if (!checkFingerTouch(timestamp, event)) {
+                // No finger has its tip switch set any more so the pointer is released straight away
+
+                if (finger_down)
+                    releaseFinger(timestamp);
+
+                multitouch_interface->handleInterruptReport(event, timestamp);
             }
         }
     }
@@ -263,6 +710,26 @@ bool VoodooI2CTouchscreenHIDEventDriver::handleStart(IOService* provider) {
     }
     
     work_loop->retain();
+
+    OSNumber* number = OSDynamicCast(OSNumber, getProperty("PalmSize"));
+    palm_size = number ? number->unsigned32BitValue() : PALM_SIZE;
+
+    number = OSDynamicCast(OSNumber, getProperty("PalmPenRadius"));
+    palm_pen_radius = number ? number->unsigned32BitValue() : PALM_PEN_RADIUS;
+
+    if (buildTransforms() != kIOReturnSuccess) {
+        IOLog("%s::%s Could not allocate coordinate transforms\n", getName(), name);
+        return false;
+    }
+
+    buildOrientation();
+    buildPressureCurve();
+
+    number = OSDynamicCast(OSNumber, getProperty("LongPressDuration"));
+    nanoseconds_to_absolutetime((number ? number->unsigned64BitValue() : LONG_PRESS_DURATION) * 1000000ULL, &long_press_duration);
+
+    number = OSDynamicCast(OSNumber, getProperty("LongPressRadius"));
+    long_press_radius = number ? number->unsigned32BitValue() : LONG_PRESS_RADIUS;
     
     timer_source = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooI2CTouchscreenHIDEventDriver::fingerLift));
     if (!timer_source || work_loop->addEventSource(timer_source) != kIOReturnSuccess) {
@@ -270,12 +737,37 @@ bool VoodooI2CTouchscreenHIDEventDriver::handleStart(IOService* provider) {
         return false;
     }
     
-    active_framebuffer = getFramebuffer();
+    // The display may not have been published yet so we wait for it rather than looking it up once,
+    // the notification is also delivered for displays that are already published
+
+    OSDictionary* matching = serviceMatching("IODisplay");
+
+    if (matching) {
+        display_notifier = addMatchingNotification(gIOFirstPublishNotification, matching, OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &VoodooI2CTouchscreenHIDEventDriver::displayPublished), this);
+        matching->release();
+    }
     
     return true;
 }
 
 void VoodooI2CTouchscreenHIDEventDriver::handleStop(IOService* provider) {
+    if (display_notifier) {
+        display_notifier->remove();
+        display_notifier = NULL;
+    }
+
+    if (framebuffer_notifier) {
+        framebuffer_notifier->remove();
+        framebuffer_notifier = NULL;
+    }
+
+    OSSafeReleaseNULL(active_framebuffer);
+
+    if (transforms) {
+        IOFree(transforms, contacts.count * sizeof(VoodooI2CTouchscreenTransform));
+        transforms = NULL;
+    }
+
     if (timer_source) {
         timer_source->cancelTimeout();
         work_loop->removeEventSource(timer_source);
@@ -292,27 +784,34 @@ void VoodooI2CTouchscreenHIDEventDriver::handleStop(IOService* provider) {
 
 void VoodooI2CTouchscreenHIDEventDriver::scrollPosition(AbsoluteTime timestamp, VoodooI2CMultitouchEvent event) {
     if (start_scroll) {
-        int index = 0;
-        VoodooI2CDigitiserTransducer* transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
-        if (transducer->type == kDigitiserTransducerStylus) {
-            index = 1;
-            transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
+        // Use the first two fingers that were not rejected as palms
+
+        UInt32 indexes[2];
+        UInt32 found = 0;
+        UInt32 end = contacts.stylus_count + event.contact_count;
+
+        if (end > contacts.count)
+            end = contacts.count;
+
+        for (UInt32 index = contacts.stylus_count; index < end && found < 2; index++) {
+            if (contacts.transducers[index]->is_valid && transforms[index].valid)
+                indexes[found++] = index;
         }
-        
-        if (!transducer || transducer->logical_max_x == 0 || transducer->logical_max_y == 0)
+
+        if (found < 2)
             return;
+
+        VoodooI2CDigitiserTransducer* transducer = contacts.transducers[indexes[0]];
+        const VoodooI2CTouchscreenTransform* transform = &transforms[indexes[0]];
         
-        IOFixed x = ((UInt32)transducer->coordinates.x.value() * 0xFFFF) / transducer->logical_max_x;
-        IOFixed y = ((UInt32)transducer->coordinates.y.value() * 0xFFFF) / transducer->logical_max_y;
-        
-        index++;
-        transducer = OSDynamicCast(VoodooI2CDigitiserTransducer, event.transducers->getObject(index));
+        IOFixed x = scaleAxis(&transform->x, (UInt32)transducer->coordinates.x.value());
+        IOFixed y = scaleAxis(&transform->y, (UInt32)transducer->coordinates.y.value());
         
-        if (!transducer || transducer->logical_max_x == 0 || transducer->logical_max_y == 0)
-            return;
+        transducer = contacts.transducers[indexes[1]];
+        transform = &transforms[indexes[1]];
 
-        IOFixed x2 = ((UInt32)transducer->coordinates.x.value() * 0xFFFF) / transducer->logical_max_x;
-        IOFixed y2 = ((UInt32)transducer->coordinates.y.value() * 0xFFFF) / transducer->logical_max_y;
+        IOFixed x2 = scaleAxis(&transform->x, (UInt32)transducer->coordinates.x.value());
+        IOFixed y2 = scaleAxis(&transform->y, (UInt32)transducer->coordinates.y.value());
         
         IOFixed cursor_x = (x+x2)/2;
         IOFixed cursor_y = (y+y2)/2;
@@ -326,7 +825,7 @@ void VoodooI2CTouchscreenHIDEventDriver::scrollPosition(AbsoluteTime timestamp,
         last_id = transducer->secondary_id;
         
         start_scroll = false;
+
+        fingerDown();
     }
-    
-    timer_source->setTimeoutMS(14);
 }
@@ -24,6 +24,74 @@
 
 #include "VoodooI2CMultitouchHIDEventDriver.hpp"
 
+#define FINGER_LIFT_TIMEOUT 50      // ms without reports before a touching finger is considered lifted
+
+#define LONG_PRESS_DURATION 1000    // ms, default for the LongPressDuration property
+#define LONG_PRESS_RADIUS   0x400   // default for the LongPressRadius property, in the 0 - 0xFFFF pointer range
+
+#define PALM_SIZE           10      // default for the PalmSize property, in percent of the panel
+#define PALM_PEN_RADIUS     0x3000  // default for the PalmPenRadius property, in the 0 - 0xFFFF pointer range
+
+#define PRESSURE_CURVE_SHIFT 8
+#define PRESSURE_CURVE_SIZE  ((0x10000 >> PRESSURE_CURVE_SHIFT) + 1)
+
+/* Scales a logical coordinate to the 0 - 0xFFFF range used by pointer events
+ *
+ * The division by the logical maximum is replaced by a multiplication with its 32.32 fixed-point reciprocal. The
+ * reciprocal is rounded down so the quotient is at most one short, which a single correction step puts right. The
+ * result is bit for bit that of `(value * 0xFFFF) / divisor`.
+ */
+
+typedef struct {
+    UInt32 divisor;
+    UInt64 reciprocal;
+} VoodooI2CTouchscreenAxisScale;
+
+/* Everything needed to turn the logical values of a transducer into pointer event values, built once per transducer
+ *
+ * @valid `false` if one of the logical maxima needed by this transducer is zero
+ * @palm `true` while the contact in this slot is rejected as a palm, it stays rejected until it lifts
+ * @palm_width The contact width from which a finger is taken to be a palm, 0 if it is not checked
+ * @palm_height The contact height from which a finger is taken to be a palm, 0 if it is not checked
+ */
+
+typedef struct {
+    bool                          valid;
+    bool                          palm;
+    UInt32                        palm_width;
+    UInt32                        palm_height;
+    VoodooI2CTouchscreenAxisScale x;
+    VoodooI2CTouchscreenAxisScale y;
+    VoodooI2CTouchscreenAxisScale z;
+    VoodooI2CTouchscreenAxisScale pressure;
+} VoodooI2CTouchscreenTransform;
+
+/* Pen pressure response built from the PressureGamma, PressureMinimum and PressureMaximum properties
+ *
+ * @linear `true` if the response is the identity, in which case <table> is not used
+ * @table The output pressure at every 1/256th of the input range, values in between are interpolated linearly
+ */
+
+typedef struct {
+    bool   linear;
+    UInt32 table[PRESSURE_CURVE_SIZE];
+} VoodooI2CTouchscreenPressureCurve;
+
+static inline void setAxisScale(VoodooI2CTouchscreenAxisScale* scale, UInt32 divisor) {
+    scale->divisor = divisor;
+    scale->reciprocal = divisor ? (1ULL << 32) / divisor : 0;
+}
+
+static inline IOFixed scaleAxis(const VoodooI2CTouchscreenAxisScale* scale, UInt32 value) {
+    UInt32 numerator = value * 0xFFFF;
+    UInt32 quotient = static_cast<UInt32>((numerator * scale->reciprocal) >> 32);
+
+    if (numerator - quotient * scale->divisor >= scale->divisor)
+        quotient++;
+
+    return quotient;
+}
+
 /* Implements an HID Event Driver for touchscreen devices as well as stylus input.
  */
 
@@ -55,12 +123,41 @@ class VoodooI2CTouchscreenHIDEventDriver : public VoodooI2CMultitouchHIDEventDri
 
     bool checkStylus(AbsoluteTime timestamp, VoodooI2CMultitouchEvent event);
 
+    /* Dispatches the pointer event of a single stylus if it is in range
+     *
+     * @timestamp The timestamp of the current event being processed
+     * @index The index of the stylus in <contacts.transducers>
+     *
+     * @return `true` if the stylus was in range and an event was dispatched, `false` otherwise
+     */
+
+    bool dispatchStylus(AbsoluteTime timestamp, UInt32 index);
+
  private:
     IOWorkLoop *work_loop;
     IOTimerEventSource *timer_source;
     
     IOFramebuffer* active_framebuffer;
-    UInt8 current_rotation;
+    volatile UInt8 current_rotation;
+
+    /* Per transducer transforms, indexed like <contacts.transducers>
+     */
+
+    VoodooI2CTouchscreenTransform* transforms;
+
+    /* Rotation of the display folded into an origin and a sign per axis, rebuilt when <current_rotation> changes
+     */
+
+    struct {
+        UInt8   rotation;
+        bool    swap_axes;
+        IOFixed origin_x;
+        IOFixed origin_y;
+        SInt32  sign_x;
+        SInt32  sign_y;
+    } orientation;
+    IONotifier* display_notifier;
+    IONotifier* framebuffer_notifier;
     
     /* transducer variables
      */
@@ -69,9 +166,18 @@ class VoodooI2CTouchscreenHIDEventDriver : public VoodooI2CMultitouchHIDEventDri
     UInt32 stylus_buttons = 0;
     IOFixed last_x = 0;
     IOFixed last_y = 0;
-    UInt32 barrel_switch_offset = 0;
-    UInt32 eraser_switch_offset = 0;
     SInt32 last_id = 0;
+
+    VoodooI2CTouchscreenPressureCurve pressure_curve;
+
+    /* Palm rejection state, the contacts that have been rejected are marked in <transforms>
+     *
+     * @valid_contact_count The number of contacts in the current report that were not rejected
+     */
+
+    UInt32 palm_size;
+    UInt32 palm_pen_radius;
+    UInt8 valid_contact_count = 0;
     
     /* handler variables
      */
@@ -79,10 +185,38 @@ class VoodooI2CTouchscreenHIDEventDriver : public VoodooI2CMultitouchHIDEventDri
     int click_tick = 0;
     bool right_click = false;
     bool start_scroll = true;
-    UInt16 compare_input_x = 0;
-    UInt16 compare_input_y = 0;
-    int compare_input_counter = 0;
+    bool finger_down = false;
+    uint64_t last_report_time = 0;
+
+    /* Long press state, the press is held as long as the finger stays within <long_press_radius> of where it started
+     */
+
+    uint64_t long_press_duration;
+    UInt32 long_press_radius;
+
+    struct {
+        bool     active;
+        IOFixed  x;
+        IOFixed  y;
+        uint64_t start;
+    } hold;
     
+    /* Marks the fingers that look like palms as invalid so that neither the single touch path nor the multitouch
+     * engines act on them
+     *
+     * A finger is taken to be a palm if the device has no confidence in it, if it is at least <palm_size> percent of
+     * the panel wide or high, or if it is within <palm_pen_radius> of a stylus that is in range. Once rejected, a
+     * contact stays rejected until it lifts.
+     *
+     * @contact_count The contact count of the current report
+     *
+     * Rejected contacts keep their slots and the contact count of the event is left alone.
+     *
+     * @return The number of contacts that were not rejected
+     */
+
+    UInt8 rejectPalms(UInt8 contact_count);
+
     /* The transducer is checked for singletouch finger based operation and the pointer event dispatched. This function
      * also handles a long-press, right-click function.
      *
@@ -102,13 +236,94 @@ class VoodooI2CTouchscreenHIDEventDriver : public VoodooI2CMultitouchHIDEventDri
      */
 
     void checkRotation(IOFixed* x, IOFixed* y);
+
+    /* Rebuilds <orientation> from <current_rotation>
+     */
+
+    void buildOrientation();
+
+    /* Allocates <transforms> and fills it from the logical maxima of the transducers in <contacts>
+     *
+     * @return *kIOReturnSuccess* on success, *kIOReturnNoMemory* if the transforms could not be allocated
+     */
+
+    IOReturn buildTransforms();
+
+    /* Fills <pressure_curve> from the PressureGamma, PressureMinimum and PressureMaximum properties
+     *
+     * PressureGamma is given in hundredths and PressureMinimum and PressureMaximum in percent of the full pressure
+     * range. Pressure below the minimum is reported as none and pressure above the maximum as full, the range in
+     * between is raised to the power of the gamma.
+     */
+
+    void buildPressureCurve();
+
+    /* Passes a scaled tip pressure through <pressure_curve>
+     *
+     * @pressure The tip pressure in the 0 - 0xFFFF range
+     *
+     * @return The tip pressure after the pressure response has been applied
+     */
+
+    IOFixed applyPressureCurve(IOFixed pressure);
     
-    /* This timeout based function executes a singletouch finger based pointer lift event as well as ensures that the pointer is not
-     * stuck in a 'right click' mode after the long-press right-click function has been triggered.
+    /* Advances the long-press right-click detector with the position of a single touching finger
+     *
+     * @timestamp The timestamp of the current event being processed
+     * @x The scaled x coordinate of the finger
+     * @y The scaled y coordinate of the finger
+     */
+
+    void checkLongPress(AbsoluteTime timestamp, IOFixed x, IOFixed y);
+
+    /* Marks the single touch pointer as down and arms the stuck contact timer if it was not already down
+     */
+
+    void fingerDown();
+
+    /* Executes a singletouch finger based pointer lift event and ensures that the pointer is not stuck in a 'right click'
+     * mode after the long-press right-click function has been triggered.
+     *
+     * @timestamp The timestamp of the report in which the finger was lifted
+     */
+
+    void releaseFinger(AbsoluteTime timestamp);
+
+    /* Safety net for panels that stop reporting without signalling a lift, releases the pointer once no report has
+     * arrived for <FINGER_LIFT_TIMEOUT> ms
      */
     void fingerLift();
     
-    IOFramebuffer* getFramebuffer();
+    /* Called when an IODisplay is published, attaches to its framebuffer if we do not have one yet
+     *
+     * @refCon Unused
+     * @display The display that was published
+     * @notifier The notifier that called us
+     *
+     * @return `true`
+     */
+
+    bool displayPublished(void* refCon, IOService* display, IONotifier* notifier);
+
+    /* Called by the active framebuffer when its state changes so that a rotation can be picked up
+     *
+     * @self The event driver
+     * @ref Unused
+     * @framebuffer The framebuffer that sent the notification
+     * @event The framebuffer event
+     * @info Event specific information
+     *
+     * @return *kIOReturnSuccess*
+     */
+
+    static IOReturn framebufferNotification(OSObject* self, void* ref, IOFramebuffer* framebuffer, IOIndex event, void* info);
+
+    /* Reads the rotation of the active framebuffer and passes it on to the multitouch interface if it has changed
+     *
+     * @force Pass the rotation on even if it has not changed
+     */
+
+    void updateRotation(bool force);
     
     /* Resets the pointer to the current finger location when scrolling begins
      *